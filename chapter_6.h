@@ -2,6 +2,12 @@
 #define _CHAPTER_H_
 
 #include "common.h"
+#include "node_pool.h"
+#include "wait_strategy.h"
+#include "epoch.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // single thread version list
 template <typename T>
@@ -91,19 +97,22 @@ private:
 // 这个队列的实现将作为第7章无锁队列的基础。这是一个无界(unbounded)队列;线程可以持续向队列中添加数据项，即使没有元素被删除。
 // 与之相反的就是有界(bounded)队列，在有界队列中，队列在创建的时候最大长度就已经是固定的了。当有界队列满载时，尝试在向其添加元素的操作将会失败或者阻塞，
 // 直到有元素从队列中弹出。在任务执行时(详见第8章)，有界队列对于线程间的工作花费是很有帮助的。其会阻止线程对队列进行填充，并且可以避免线程从较远的地方对数据项进行索引。
-template <typename T>
+// Alloc是节点和数据的分配策略，默认使用std::allocator；换成pool_allocator后稳定状态下push/pop不再调用malloc/free。
+// 分配策略需要是无状态的(可以随时默认构造)
+template <typename T, typename Alloc = allocator<T>>
 class thread_safe_queue {
 public:
-    thread_safe_queue(): _head(new node), _tail(_head.get()) {}
+    explicit thread_safe_queue(wait_strategy const & strategy = wait_strategy())
+        : _head(node_store::create()), _tail(_head.get()), _strategy(strategy) {}
     thread_safe_queue(const thread_safe_queue & other) = delete;
     thread_safe_queue operator=(const thread_safe_queue & other) = delete;
 
     shared_ptr<T> try_pop() {
-        unique_ptr<node> old_head = pop_head();
+        node_ptr old_head = pop_head();
         return old_head ? old_head->data : shared_ptr<T>();
     }
     bool try_pop(T & value) {
-        unique_ptr<node> const old_head = pop_head(value);
+        node_ptr const old_head = pop_head(value);
         return old_head != nullptr;
     }
 
@@ -114,54 +123,155 @@ public:
 
     // normal version
     void push(T new_value) {
-        shared_ptr<T> new_data(make_shared<T>(move(new_value)));
-        unique_ptr<node> p(new node);
+        shared_ptr<T> data(make_policy_shared<T>(Alloc(), move(new_value)));
+        node_ptr p(node_store::create());
         node * const new_tail = p.get();
-        lock_guard<mutex> tail_lock(tail_mutex);
-        _tail->data = new_data;
-        _tail->next = move(p);
-        _tail = new_tail;
+        {
+            lock_guard<mutex> tail_lock(tail_mutex);
+            check_not_closed();
+            _tail->data = data;
+            _tail->next = move(p);
+            _tail = new_tail;
+        }
+        // 没有线程挂起时只是一次原子加，不会进入内核
+        _data_ready.notify_one();
     }
 
-    // condition version
+    // notify version，现在push也会通知，两者等价，保留这个接口
     // 当将互斥量和notify_one()混用的时，如果被通知的线程在互斥量解锁后被唤醒，那么这个线程就不得不等待互斥量上锁。
     // 另一方面，当解锁操作在notify_one()之前调用，那么互斥量可能会等待线程醒来，来获取互斥锁(假设没有其他线程对互斥量上锁)。
     void push_cond(T new_value) {
-        shared_ptr<T> new_data(make_shared<T>(move(new_value)));
-        unique_ptr<node> p(new node);
+        shared_ptr<T> data(make_policy_shared<T>(Alloc(), move(new_value)));
+        node_ptr p(node_store::create());
         {
             lock_guard<mutex> tail_lock(tail_mutex);
-            _tail->data = new_data;
+            check_not_closed();
+            _tail->data = data;
             node * const new_tail = p.get();
             _tail->next = move(p);
             _tail = new_tail;
         }
-        data_cond.notify_one();
+        _data_ready.notify_one();
     }
 
-    // condition version
+    // 批量版本
+    // 在锁外把[first, last)构造成一条链(最后一个节点是新的虚拟节点)，持有一次tail_mutex把整条链接到队尾，
+    // 最后只发一次通知。需要移动元素时可以传入make_move_iterator
+    template <typename Iterator>
+    void push_range(Iterator first, Iterator last) {
+        if (first == last) {
+            return;
+        }
+        // 第一个元素放进当前的虚拟节点_tail中
+        shared_ptr<T> const first_data(make_policy_shared<T>(Alloc(), *first));
+        node_ptr chain(node_store::create());
+        node * chain_tail = chain.get();
+        for (++first; first != last; ++first) {
+            chain_tail->data = make_policy_shared<T>(Alloc(), *first);
+            chain_tail->next = node_ptr(node_store::create());
+            chain_tail = chain_tail->next.get();
+        }
+        {
+            lock_guard<mutex> tail_lock(tail_mutex);
+            check_not_closed();
+            _tail->data = first_data;
+            _tail->next = move(chain);
+            _tail = chain_tail;
+        }
+        _data_ready.notify_all();
+    }
+
+    // 持有一次head_mutex摘下最多max_n个节点，在锁外把数据移动到out并释放节点，返回取出的个数
+    template <typename OutputIterator>
+    size_t try_pop_bulk(OutputIterator out, size_t max_n) {
+        node_ptr old_head = pop_head_bulk(max_n);
+        size_t n = 0;
+        while (old_head) {
+            *out++ = move(*old_head->data);
+            old_head = move(old_head->next);
+            ++n;
+        }
+        return n;
+    }
+
+    // 自适应等待版本：队列为空时按照_strategy先自旋、再yield，最后才挂起(futex)
+    // 两个wait_and_pop在队列关闭并且取空后都抛出queue_closed，不想处理异常时用wait_pop
     shared_ptr<T> wait_and_pop() {
-        unique_ptr<node> const old_head = wait_pop_head();
-        return old_head->data;
+        shared_ptr<T> res;
+        pop_status const status = wait_pop_loop(_data_ready, _closed, [&] {return bool(res = try_pop());}, [&](uint32_t ticket) {
+            _data_ready.wait(ticket, _strategy);
+            return true;
+        });
+        if (status == pop_status::closed) {
+            throw queue_closed();
+        }
+        return res;
     }
-    // condition version
     void wait_and_pop(T & value) {
-        unique_ptr<node> const old_head = wait_pop_head(value);
+        if (wait_pop(value) == pop_status::closed) {
+            throw queue_closed();
+        }
+    }
+
+    // 返回状态的版本：success或者closed(已关闭并且取空)
+    pop_status wait_pop(T & value) {
+        return wait_pop_loop(_data_ready, _closed, [&] {return try_pop(value);}, [&](uint32_t ticket) {
+            _data_ready.wait(ticket, _strategy);
+            return true;
+        });
+    }
+
+    // 带超时的版本，到期仍然没有数据返回timeout
+    template <typename Rep, typename Period>
+    pop_status wait_and_pop_for(T & value, chrono::duration<Rep, Period> const & timeout) {
+        return wait_and_pop_until(value, chrono::steady_clock::now() + timeout);
+    }
+    template <typename Clock, typename Duration>
+    pop_status wait_and_pop_until(T & value, chrono::time_point<Clock, Duration> const & deadline) {
+        return wait_pop_loop(_data_ready, _closed, [&] {return try_pop(value);}, [&](uint32_t ticket) {
+            return _data_ready.wait_until(ticket, _strategy, deadline);
+        });
+    }
+
+    // 关闭队列：之后的push会抛出queue_closed，所有等待中的消费者被一次性唤醒，
+    // 它们会先取完剩下的数据，再得到closed，不需要再轮询标志位
+    void close() {
+        {
+            lock_guard<mutex> tail_lock(tail_mutex);
+            _closed.store(true, memory_order_release);
+        }
+        _data_ready.notify_all();
+    }
+    bool closed() const {
+        return _closed.load(memory_order_acquire);
     }
 
 private:
+    struct node;
+    using node_store = policy_nodes<node, Alloc>;
+    using node_ptr = unique_ptr<node, typename node_store::deleter>;
+
     struct node {
         shared_ptr<T> data;
-        unique_ptr<node> next;
+        node_ptr next;
     };
 
     mutex head_mutex;
-    unique_ptr<node> _head;
+    node_ptr _head;
 
     mutex tail_mutex;
     node * _tail;
 
-    condition_variable data_cond;
+    parking_event _data_ready;
+    wait_strategy _strategy;
+    atomic<bool> _closed{false};
+
+    // 调用者持有tail_mutex
+    void check_not_closed() const {
+        if (_closed.load(memory_order_relaxed)) {
+            throw queue_closed();
+        }
+    }
 
     node * get_tail() {
         lock_guard<mutex> tail_lock(tail_mutex);
@@ -169,14 +279,14 @@ private:
     }
 
     // normal version
-    unique_ptr<node> pop_head() {
+    node_ptr pop_head() {
         lock_guard<mutex> head_lock(head_mutex);
-        if (_head.get() = get_tail()) {
+        if (_head.get() == get_tail()) {
             return nullptr;
         }
         return pop_head_cond();
     }
-    unique_ptr<node> pop_head(T & value) {
+    node_ptr pop_head(T & value) {
         lock_guard<mutex> head_lock(head_mutex);
         if (_head.get() == get_tail()) {
             return nullptr;
@@ -184,127 +294,1866 @@ private:
         value = move(*_head->data);
         return pop_head_cond();
     }
+    // 批量版本，返回摘下的链表，最后一个节点的next为空
+    node_ptr pop_head_bulk(size_t max_n) {
+        lock_guard<mutex> head_lock(head_mutex);
+        node * const tail = get_tail();
+        if (!max_n || _head.get() == tail) {
+            return nullptr;
+        }
+        node * last = _head.get();
+        for (size_t n = 1; n < max_n && last->next.get() != tail; ++n) {
+            last = last->next.get();
+        }
+        node_ptr old_head = move(_head);
+        _head = move(last->next);
+        return old_head;
+    }
 
     // condition version
-    unique_ptr<node> pop_head_cond() {
-        unique_ptr<node> old_head = move(_head);
+    node_ptr pop_head_cond() {
+        node_ptr old_head = move(_head);
         _head = move(old_head->next);
         return old_head;
     }
-    // condition version
-    unique_lock<mutex> wait_for_data() {
-        unique_lock<mutex> head_lock(head_mutex);
-        data_cond.wait(head_lock,[&] {return _head.get() != get_tail();});
-        return move(head_lock);
+};
+
+// thread_safe_queue的值语义版本
+// 节点里直接存放T(optional<T>)，不再为每个元素单独分配shared_ptr<T>；emplace在节点里原地构造，pop时把值移动出来，
+// 所以unique_ptr、大缓冲区这类只能移动的类型也可以放进队列，而且全程不会被拷贝。
+// 和thread_safe_queue一样_head指向虚拟节点，区别在于数据放在新节点里：push在锁外构造好带数据的节点再挂到_tail后面，
+// pop把_head->next中的值移走，next成为新的虚拟节点。
+template <typename T, typename Alloc = allocator<T>>
+class value_queue {
+public:
+    explicit value_queue(wait_strategy const & strategy = wait_strategy())
+        : _head(node_store::create()), _tail(_head.get()), _strategy(strategy) {}
+    value_queue(const value_queue & other) = delete;
+    value_queue & operator=(const value_queue & other) = delete;
+
+    template <typename... Args>
+    void emplace(Args &&... args) {
+        node_ptr p(node_store::create());
+        p->data.emplace(forward<Args>(args)...);
+        node * const new_tail = p.get();
+        {
+            lock_guard<mutex> tail_lock(tail_mutex);
+            _tail->next = move(p);
+            _tail = new_tail;
+        }
+        _data_ready.notify_one();
     }
-    // condition version
-    unique_ptr<node> wait_pop_head() {
-        unique_lock<mutex> head_lock(wait_for_data());
-        return pop_head_cond();
+    void push(T new_value) {
+        emplace(move(new_value));
     }
-    // condition version
-    unique_ptr<node> wait_pop_head(T & value) {
-        unique_lock<mutex> head_lock(wait_for_data());
-        value = move(*_head->data);
-        return pop_head_cond();
+
+    optional<T> try_pop() {
+        optional<T> res;
+        node_ptr const old_head = pop_head(res);
+        return res;
+    }
+    bool try_pop(T & value) {
+        optional<T> res;
+        node_ptr const old_head = pop_head(res);
+        if (!res) {
+            return false;
+        }
+        value = move(*res);
+        return true;
+    }
+
+    // 和thread_safe_queue一样自旋、yield之后才挂起
+    T wait_and_pop() {
+        for (;;) {
+            uint32_t const ticket = _data_ready.prepare_wait();
+            if (optional<T> res = try_pop()) {
+                return move(*res);
+            }
+            _data_ready.wait(ticket, _strategy);
+        }
+    }
+    void wait_and_pop(T & value) {
+        for (;;) {
+            uint32_t const ticket = _data_ready.prepare_wait();
+            if (try_pop(value)) {
+                return;
+            }
+            _data_ready.wait(ticket, _strategy);
+        }
+    }
+
+    bool empty() {
+        lock_guard<mutex> head_lock(head_mutex);
+        return _head.get() == get_tail();
+    }
+
+private:
+    struct node;
+    using node_store = policy_nodes<node, Alloc>;
+    using node_ptr = unique_ptr<node, typename node_store::deleter>;
+
+    struct node {
+        optional<T> data;
+        node_ptr next;
+    };
+
+    mutex head_mutex;
+    node_ptr _head;
+
+    mutex tail_mutex;
+    node * _tail;
+
+    parking_event _data_ready;
+    wait_strategy _strategy;
+
+    node * get_tail() {
+        lock_guard<mutex> tail_lock(tail_mutex);
+        return _tail;
+    }
+
+    // 调用者持有head_mutex；值必须在锁内移走，解锁后next(新的虚拟节点)可能被其他消费者释放
+    node_ptr take_head(optional<T> & value) {
+        node_ptr old_head = move(_head);
+        _head = move(old_head->next);
+        value = move(_head->data);
+        _head->data.reset();
+        return old_head;
+    }
+
+    node_ptr pop_head(optional<T> & value) {
+        lock_guard<mutex> head_lock(head_mutex);
+        if (_head.get() == get_tail()) {
+            return nullptr;
+        }
+        return take_head(value);
     }
 };
 
-// 6.3 基于锁设计更加复杂的数据结构
-// 6.3.1 编写一个使用锁的线程安全查询表
-// 查询表基本操作有： 添加、修改、删除、通过给定键值获取对应数据
-template <typename Key, typename Value, typename Hash = hash<Key>>
-class thread_safe_lookup_table {
+// 有界(bounded)无锁多生产者多消费者(MPMC)环形队列
+// 与thread_safe_queue接口一致(push/try_pop/wait_and_pop)，但容量固定为2的幂，元素直接构造在预分配的槽(slot)中，
+// push/pop不会再有任何堆分配(返回shared_ptr<T>的重载除外)，也不需要head_mutex/tail_mutex。
+// 每个槽带一个序号seq：
+//   seq == pos        槽空闲，可以被写入位置pos的生产者占用
+//   seq == pos + 1    槽已写入，可以被读取位置pos的消费者取走
+//   消费者取走后把seq设为 pos + capacity，留给下一圈的生产者
+// 生产者/消费者只需要用CAS抢占_enqueue_pos/_dequeue_pos，再通过seq的release/acquire交接数据。
+template <typename T>
+class bounded_mpmc_queue {
+public:
+    // capacity会向上取整到2的幂，并且至少为2：只有一个槽时 seq == pos + 1 既表示"已写入"又表示"下一圈空闲"，
+    // 第二次push会覆盖还没有被取走的元素
+    explicit bounded_mpmc_queue(size_t capacity)
+        : _mask(round_up_pow2(max<size_t>(capacity, 2)) - 1), _slots(new slot[_mask + 1]) {
+        for (size_t i = 0; i <= _mask; ++i) {
+            _slots[i].seq.store(i, memory_order_relaxed);
+        }
+        _enqueue_pos.store(0, memory_order_relaxed);
+        _dequeue_pos.store(0, memory_order_relaxed);
+    }
+    bounded_mpmc_queue(const bounded_mpmc_queue & other) = delete;
+    bounded_mpmc_queue & operator=(const bounded_mpmc_queue & other) = delete;
+
+    ~bounded_mpmc_queue() {
+        // 析构时已经没有并发访问，直接销毁还留在队列里的元素
+        size_t const tail = _enqueue_pos.load(memory_order_relaxed);
+        for (size_t pos = _dequeue_pos.load(memory_order_relaxed); pos != tail; ++pos) {
+            _slots[pos & _mask].value()->~T();
+        }
+    }
+
+    // 队列满时返回false，生产者可以据此感知背压(backpressure)；失败时不会移走new_value
+    bool try_push(T const & new_value) {
+        return do_try_push(new_value);
+    }
+    bool try_push(T && new_value) {
+        return do_try_push(move(new_value));
+    }
+
+    // 队列满时让出CPU并重试，直到写入成功
+    void push(T new_value) {
+        while (!try_push(move(new_value))) {
+            this_thread::yield();
+        }
+    }
+
+    bool try_pop(T & value) {
+        slot * const s = acquire_pop_slot();
+        if (!s) {
+            return false;
+        }
+        value = move(*s->value());
+        release_pop_slot(s);
+        return true;
+    }
+    shared_ptr<T> try_pop() {
+        slot * const s = acquire_pop_slot();
+        if (!s) {
+            return shared_ptr<T>();
+        }
+        shared_ptr<T> const res(make_shared<T>(move(*s->value())));
+        release_pop_slot(s);
+        return res;
+    }
+
+    void wait_and_pop(T & value) {
+        while (!try_pop(value)) {
+            this_thread::yield();
+        }
+    }
+    shared_ptr<T> wait_and_pop() {
+        shared_ptr<T> res;
+        while (!(res = try_pop())) {
+            this_thread::yield();
+        }
+        return res;
+    }
+
+    // 只是一个瞬时快照，并发场景下返回后可能立即失效
+    bool empty() const {
+        return _dequeue_pos.load(memory_order_acquire) >= _enqueue_pos.load(memory_order_acquire);
+    }
+
+    size_t capacity() const {
+        return _mask + 1;
+    }
+
 private:
-    class bucket_type {
-    public:
+    // 每个槽独占缓存行，相邻槽的生产者/消费者不会互相干扰
+    struct alignas(cache_line_size) slot {
+        atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T * value() {
+            return launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    size_t const _mask;
+    unique_ptr<slot[]> const _slots;
+    // 生产者和消费者的游标放在不同的缓存行上
+    alignas(cache_line_size) atomic<size_t> _enqueue_pos;
+    alignas(cache_line_size) atomic<size_t> _dequeue_pos;
 
-        Value value_for(Key const & key, Value const & value) const {
-            shared_lock<shared_mutex> lock(sh_mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            return (found_entry == data.end()) ? value : found_entry->second;
+    static size_t round_up_pow2(size_t n) {
+        size_t res = 1;
+        while (res < n) {
+            res <<= 1;
         }
+        return res;
+    }
 
-        void add_or_update_mapping(Key const & key, Value const & value) {
-            unique_lock<shared_mutex> lock(sh_mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            if (found_entry == data.end()) {
-                data.push_back(bucket_value(key, value));
+    template <typename U>
+    bool do_try_push(U && new_value) {
+        size_t pos = _enqueue_pos.load(memory_order_relaxed);
+        slot * s;
+        for (;;) {
+            s = &_slots[pos & _mask];
+            size_t const seq = s->seq.load(memory_order_acquire);
+            intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                // 槽空闲，抢占这个位置
+                if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // 上一圈的数据还没被取走，队列已满
+                return false;
             } else {
-                found_entry->second = value;
+                // 被其他生产者抢先了
+                pos = _enqueue_pos.load(memory_order_relaxed);
             }
         }
+        new (s->storage) T(forward<U>(new_value));
+        s->seq.store(pos + 1, memory_order_release);
+        return true;
+    }
 
-        void remove_mapping(Key const & key) {
-            unique_lock<shared_mutex> lock(sh_mutex);
-            bucket_iterator const found_entry = find_entry_for(key);
-            if (found_entry == data.end()) {
-                data.erase(found_entry);
+    // 成功时返回已被当前线程独占的槽，调用者取走数据后必须调用release_pop_slot
+    slot * acquire_pop_slot() {
+        size_t pos = _dequeue_pos.load(memory_order_relaxed);
+        for (;;) {
+            slot * const s = &_slots[pos & _mask];
+            size_t const seq = s->seq.load(memory_order_acquire);
+            intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    return s;
+                }
+            } else if (diff < 0) {
+                // 队列为空
+                return nullptr;
+            } else {
+                pos = _dequeue_pos.load(memory_order_relaxed);
             }
         }
+    }
 
-    private:
-        using bucket_value = pair<Key, Value>;
-        using bucket_data = list<bucket_value>;
-        using bucket_iterator = typename bucket_data::iterator;
+    void release_pop_slot(slot * s) {
+        size_t const pos = s->seq.load(memory_order_relaxed) - 1;
+        s->value()->~T();
+        s->seq.store(pos + _mask + 1, memory_order_release);
+    }
+};
 
-        bucket_data data;
-        mutable shared_mutex sh_mutex;
+// 松弛(relaxed)并发优先队列：MultiQueue
+// 由 shards_per_thread * 线程数 个分片组成，每个分片是一个加锁的二叉堆。
+// push随机选一个能立即锁上的分片插入；pop随机看choices个分片的堆顶(不加锁，读缓存的top)，
+// 从其中优先级最高的分片取出。不保证严格的优先级顺序，但取出的元素总是接近最高优先级，
+// 而且不同线程基本不会争用同一把锁。choices越大越接近严格顺序，分片越多争用越少。
+// Priority是数值类型，Compare和priority_queue一样，默认less<Priority>表示数值大的优先
+template <typename T, typename Priority = int, typename Compare = less<Priority>>
+class multi_queue {
+public:
+    explicit multi_queue(unsigned shards_per_thread = 2, unsigned choices = 2,
+                         unsigned thread_count = thread::hardware_concurrency(),
+                         wait_strategy const & strategy = wait_strategy())
+        : _num_shards(max(1u, shards_per_thread * max(1u, thread_count))),
+          _choices(max(1u, choices)),
+          _shards(new shard[_num_shards]),
+          _strategy(strategy) {}
+    multi_queue(const multi_queue & other) = delete;
+    multi_queue & operator=(const multi_queue & other) = delete;
 
-        bucket_iterator find_entry_for(Key const & key) const {
-            // O(n), traverse list
-            return find_if(data.begin(), data.end(), [&](bucket_value const & item) {
-                return item.first == key;
-            });
+    void push(Priority priority, T value) {
+        for (unsigned tries = 1; ; ++tries) {
+            shard & s = _shards[random_index()];
+            unique_lock<mutex> lk(s.m, try_to_lock);
+            if (!lk.owns_lock()) {
+                // 分片很少时不要一直空转
+                if (tries < _num_shards) {
+                    continue;
+                }
+                lk.lock();
+            }
+            if (_closed.load(memory_order_acquire)) {
+                throw queue_closed();
+            }
+            s.heap.emplace_back(priority, move(value));
+            push_heap(s.heap.begin(), s.heap.end(), entry_compare{_comp});
+            s.publish_top();
+            break;
         }
-    };
+        _data_ready.notify_one();
+    }
 
-public:
-    using key_type = Key;
-    using mapped_type = Value;
-    using hash_type = Hash;
-    thread_safe_lookup_table(unsigned num_buckets = 19, Hash const & hasher_ = Hash()) : buckets(num_buckets), hasher(hasher_) {
-        for (auto i = 0; i < num_buckets; ++i) {
-            buckets[i].reset(new bucket_type);
+    bool try_pop(T & value) {
+        // 随机采样几轮；采到的分片都为空时，再逐个扫描全部分片，确认真的为空才返回false
+        for (unsigned attempt = 0; attempt < _num_shards; ++attempt) {
+            shard * best = nullptr;
+            for (unsigned i = 0; i < _choices; ++i) {
+                shard & s = _shards[random_index()];
+                if (!s.size.load(memory_order_acquire)) {
+                    continue;
+                }
+                if (!best || _comp(best->top.load(memory_order_relaxed), s.top.load(memory_order_relaxed))) {
+                    best = &s;
+                }
+            }
+            if (!best) {
+                break;
+            }
+            unique_lock<mutex> lk(best->m, try_to_lock);
+            if (lk.owns_lock() && pop_from(*best, value)) {
+                return true;
+            }
+        }
+        for (unsigned i = 0; i < _num_shards; ++i) {
+            lock_guard<mutex> lk(_shards[i].m);
+            if (pop_from(_shards[i], value)) {
+                return true;
+            }
         }
+        return false;
     }
-    thread_safe_lookup_table(thread_safe_lookup_table const & other) = delete;
-    thread_safe_lookup_table & operator=(thread_safe_lookup_table const & other) = delete;
 
-    Value value_for(Key const & key, Value const & default_value = Value()) const {
-        return get_bucket(key).value_for(key,default_value);
+    // 阻塞版本和thread_safe_queue一致：success或者closed(已关闭并且取空)
+    pop_status wait_pop(T & value) {
+        return wait_pop_loop(_data_ready, _closed, [&] {return try_pop(value);}, [&](uint32_t ticket) {
+            _data_ready.wait(ticket, _strategy);
+            return true;
+        });
+    }
+    void wait_and_pop(T & value) {
+        if (wait_pop(value) == pop_status::closed) {
+            throw queue_closed();
+        }
     }
 
-    void add_or_update_mapping(Key const & key, Value const & value) {
-        get_bucket(key).add_or_update_mapping(key, value);
+    // 设置关闭标志后依次锁一遍所有分片，保证没看到标志的push都已经完成，再唤醒所有等待者
+    void close() {
+        _closed.store(true, memory_order_release);
+        for (unsigned i = 0; i < _num_shards; ++i) {
+            lock_guard<mutex> lk(_shards[i].m);
+        }
+        _data_ready.notify_all();
     }
-    void remove_mapping(Key const & key) {
-        get_bucket(key).remove_mapping(key);
+    bool closed() const {
+        return _closed.load(memory_order_acquire);
     }
 
-    // 查询表的一个“可有可无”(nice-to-have)的特性，会将选择当前状态的快照，例如，一个std::map<>
-    // 这将要求锁住整个容器，用来保证拷贝副本的状态是可以索引的，这将要求锁住所有的桶。因为对于查询表的“普通”的操作，
-    // 需要在同一时间获取一个桶上的一个锁，而这个操作将要求查询表将所有桶都锁住。因此，只要每次以相同的顺序进行上锁(例如，递增桶的索引值)，就不会产生死锁。
-    map<Key,Value> get_map() const {
-        vector<unique_lock<shared_mutex>> locks;
-        for (unsigned int i = 0; i < buckets.size(); i++) {
-            locks.push_back(unique_lock<shared_mutex>(buckets[i]->sh_mutex));
+    // 只是一个瞬时快照
+    size_t size() const {
+        size_t res = 0;
+        for (unsigned i = 0; i < _num_shards; ++i) {
+            res += _shards[i].size.load(memory_order_relaxed);
         }
-        map<Key, Value> res;
-        for (unsigned int i = 0; i < buckets.size(); i++) {
-            for (auto it = buckets[i].data.begin(); it != buckets[i].data.end();++it) {
-                res.insert(*it);
+        return res;
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    static_assert(is_arithmetic<Priority>::value, "Priority must be an arithmetic type");
+
+    using entry = pair<Priority, T>;
+
+    struct entry_compare {
+        Compare comp;
+        bool operator()(entry const & lhs, entry const & rhs) const {
+            return comp(lhs.first, rhs.first);
+        }
+    };
+
+    // 每个分片独占缓存行；top和size在锁内更新，pop采样时无锁读取
+    struct alignas(cache_line_size) shard {
+        mutex m;
+        vector<entry> heap;
+        atomic<Priority> top{};
+        atomic<size_t> size{0};
+
+        void publish_top() {
+            if (!heap.empty()) {
+                top.store(heap.front().first, memory_order_relaxed);
             }
+            size.store(heap.size(), memory_order_release);
         }
-        return res;
+    };
+
+    unsigned const _num_shards;
+    unsigned const _choices;
+    unique_ptr<shard[]> const _shards;
+    Compare _comp;
+    parking_event _data_ready;
+    wait_strategy _strategy;
+    atomic<bool> _closed{false};
+
+    // 调用者持有s.m
+    bool pop_from(shard & s, T & value) {
+        if (s.heap.empty()) {
+            return false;
+        }
+        pop_heap(s.heap.begin(), s.heap.end(), entry_compare{_comp});
+        value = move(s.heap.back().second);
+        s.heap.pop_back();
+        s.publish_top();
+        return true;
+    }
+
+    // 每个线程自己的xorshift随机数，不需要同步
+    unsigned random_index() const {
+        thread_local uint64_t state = hash<thread::id>()(this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<unsigned>(state % _num_shards);
     }
+};
 
+// 6.3 基于锁设计更加复杂的数据结构
+// 6.3.1 编写一个使用锁的线程安全查询表
+// 查询表基本操作有： 添加、修改、删除、通过给定键值获取对应数据
+// 桶的数量(也就是锁的数量)在构造时确定，但每个桶内部是一个可以增长的链表数组：
+// 桶内用线性哈希(linear hashing)，元素数超过链表数时分裂一条链表，不到链表数的1/4时合并一条。
+// 每次写操作最多额外搬动一条链表，扩容/缩容是渐进的，只锁住当前这一个桶，其他桶的读写不受影响
+// 读操作不加锁：节点链入之后键和值都不再修改(更新时换一个新节点)，摘下的节点交给epoch_domain延迟释放，
+// 读者在epoch临界区内沿着原子指针遍历即可，不会写任何共享的缓存行。写操作仍然持有桶的互斥量。
+// 分裂/合并会把节点挪到另一条链表上，读者可能因此漏掉元素，所以每个桶还有一个序号(seqlock)：
+// 分裂/合并期间序号为奇数，没找到键的读者检查序号，期间有过分裂/合并就重新查一遍；找到的结果总是正确的
+// 最后一个模板参数选择其他的实现(见lookup_backend)，value_for/add_or_update_mapping/remove_mapping的用法不变
+
+// 查询表的实现方式
+enum class lookup_backend {
+    chained,          // 桶 + 链表，就是下面这个实现
+    open_addressing,  // 锁分段的线性探测，见open_addressing_lookup_table
+    swiss             // 按组探测，一次比较16个tag，见swiss_lookup_table
+};
+
+template <typename Key, typename Value, typename Hash = hash<Key>, lookup_backend Backend = lookup_backend::chained>
+class thread_safe_lookup_table {
 private:
-    vector<unique_ptr<bucket_type>> buckets;
-    Hash hasher;
-    bucket_type & get_bucket(Key const & key) const {
-        size_t const bucket_index = hasher(key) % buckets.size();
-        return *buckets[bucket_index];
+    using bucket_value = pair<Key, Value>;
+
+    // 保存哈希值，分裂链表时不需要重新计算，查找时也先比较哈希
+    struct node {
+        size_t hash;
+        bucket_value value;
+        atomic<node *> next;
+        node(size_t h, bucket_value value_, node * next_) : hash(h), value(move(value_)), next(next_) {}
+    };
+
+    // 链表头数组，容量固定，链表数count不超过容量；链表数达到容量时换一个两倍大的数组，旧数组延迟释放
+    struct chain_array {
+        vector<atomic<node *>> heads;
+        atomic<size_t> count;
+        chain_array(size_t capacity, size_t count_) : heads(capacity), count(count_) {}
+    };
+
+    // 快照的共享状态，见snapshot()
+    struct snapshot_state {
+        mutex snapshot_mutex;
+        uint64_t last_id = 0;
+        // 正在进行(或者最近一次)的快照编号，桶上记录的编号比它小说明这个桶还没有拷进快照
+        atomic<uint64_t> active_id{0};
+        mutex entries_mutex;
+        vector<bucket_value> * entries = nullptr;
+    };
+
+    class bucket_type {
+    public:
+        explicit bucket_type(snapshot_state & snapshots_) : chains(new chain_array(1, 1)), snapshots(snapshots_) {}
+        ~bucket_type() {
+            chain_array * const c = chains.load(memory_order_relaxed);
+            for (size_t i = 0; i < c->count.load(memory_order_relaxed); ++i) {
+                node * p = c->heads[i].load(memory_order_relaxed);
+                while (p) {
+                    node * const next = p->next.load(memory_order_relaxed);
+                    delete p;
+                    p = next;
+                }
+            }
+            delete c;
+        }
+        bucket_type(bucket_type const & other) = delete;
+        bucket_type & operator=(bucket_type const & other) = delete;
+
+        Value value_for(Key const & key, size_t h, Value const & value) const {
+            epoch_domain::guard guard;
+            node const * const p = find(key, h);
+            return p ? p->value.second : value;
+        }
+
+        void add_or_update_mapping(Key const & key, size_t h, Value const & value) {
+            lock_guard<mutex> lock(write_mutex);
+            update_locked(key, h, value);
+        }
+
+        // 以下几个函数的调用者都持有write_mutex
+        void update_locked(Key const & key, size_t h, Value const & value) {
+            if (atomic<node *> * const link = find_link(key, h)) {
+                replace_locked(*link, value);
+            } else {
+                insert_locked(key, h, value);
+            }
+        }
+
+        // 指向键所在节点的链接，键不存在时返回nullptr
+        atomic<node *> * find_link(Key const & key, size_t h) {
+            chain_array * const c = chains.load(memory_order_relaxed);
+            for (atomic<node *> * link = &c->heads[chain_index(*c, h)]; node * const p = link->load(memory_order_relaxed); link = &p->next) {
+                if (p->hash == h && p->value.first == key) {
+                    return link;
+                }
+            }
+            return nullptr;
+        }
+
+        // 读者可能正在读旧节点，换上新节点，旧节点延迟释放
+        void replace_locked(atomic<node *> & link, Value value) {
+            capture_before_write();
+            node * const p = link.load(memory_order_relaxed);
+            link.store(new node(p->hash, bucket_value(p->value.first, move(value)), p->next.load(memory_order_relaxed)), memory_order_release);
+            epoch_domain::retire(p);
+        }
+
+        // 键不在桶里
+        void insert_locked(Key const & key, size_t h, Value value) {
+            capture_before_write();
+            chain_array * const c = chains.load(memory_order_relaxed);
+            atomic<node *> & head = c->heads[chain_index(*c, h)];
+            head.store(new node(h, bucket_value(key, move(value)), head.load(memory_order_relaxed)), memory_order_release);
+            if (++entry_count > c->count.load(memory_order_relaxed)) {
+                split();
+            }
+        }
+
+        // get_or_compute的计算结束(成功或者失败)
+        void finish_computing(Key const & key) {
+            for (auto it = computing.begin(); it != computing.end(); ++it) {
+                if (it->key == key) {
+                    computing.erase(it);
+                    return;
+                }
+            }
+        }
+
+        void remove_mapping(Key const & key, size_t h) {
+            lock_guard<mutex> lock(write_mutex);
+            chain_array * const c = chains.load(memory_order_relaxed);
+            for (atomic<node *> * link = &c->heads[chain_index(*c, h)]; node * const p = link->load(memory_order_relaxed); link = &p->next) {
+                if (p->hash == h && p->value.first == key) {
+                    capture_before_write();
+                    // 摘下后p->next不变，正停在p上的读者还能继续往后走
+                    link->store(p->next.load(memory_order_relaxed), memory_order_release);
+                    epoch_domain::retire(p);
+                    size_t const num_chains = c->count.load(memory_order_relaxed);
+                    if (--entry_count * 4 < num_chains && num_chains > 1) {
+                        merge();
+                    }
+                    return;
+                }
+            }
+        }
+
+        size_t size() const {
+            lock_guard<mutex> lock(write_mutex);
+            return entry_count;
+        }
+
+        // 调用者在epoch临界区内，返回的节点在离开临界区之前一直有效
+        node const * find(Key const & key, size_t h) const {
+            for (;;) {
+                uint32_t const seq = restructure_seq.load(memory_order_acquire);
+                chain_array const * const c = chains.load(memory_order_acquire);
+                for (node const * p = c->heads[chain_index(*c, h)].load(memory_order_acquire); p; p = p->next.load(memory_order_acquire)) {
+                    if (p->hash == h && p->value.first == key) {
+                        return p;
+                    }
+                }
+                atomic_thread_fence(memory_order_acquire);
+                if (!(seq & 1) && restructure_seq.load(memory_order_relaxed) == seq) {
+                    return nullptr;
+                }
+            }
+        }
+
+        // 批量查找的预取，调用者在epoch临界区内：先预取链表头所在的位置，下一轮再预取链表的第一个节点
+        void prefetch_head(size_t h) const {
+            chain_array const * const c = chains.load(memory_order_acquire);
+            prefetch(&c->heads[chain_index(*c, h)]);
+        }
+        void prefetch_first_node(size_t h) const {
+            chain_array const * const c = chains.load(memory_order_acquire);
+            prefetch(c->heads[chain_index(*c, h)].load(memory_order_acquire));
+        }
+
+        // 调用者持有write_mutex：这个桶还没有拷进正在进行的快照时，先拷贝修改之前的内容(写时复制)
+        void capture_before_write() {
+            uint64_t const id = snapshots.active_id.load(memory_order_acquire);
+            if (id != captured_snapshot) {
+                capture(id);
+            }
+        }
+        void capture(uint64_t id) {
+            lock_guard<mutex> lock(snapshots.entries_mutex);
+            chain_array const * const c = chains.load(memory_order_relaxed);
+            for (size_t i = 0; i < c->count.load(memory_order_relaxed); ++i) {
+                for (node const * p = c->heads[i].load(memory_order_relaxed); p; p = p->next.load(memory_order_relaxed)) {
+                    snapshots.entries->push_back(p->value);
+                }
+            }
+            captured_snapshot = id;
+        }
+
+    private:
+        friend class thread_safe_lookup_table;
+
+        atomic<chain_array *> chains;
+        atomic<uint32_t> restructure_seq{0};
+        snapshot_state & snapshots;
+        uint64_t captured_snapshot = 0;
+        size_t entry_count = 0;
+        mutable mutex write_mutex;
+        // 正在由get_or_compute计算的键，等待同一个键的线程共享计算的结果；owner是调用fn的线程，用来发现fn的重入
+        struct pending_computation {
+            Key key;
+            shared_future<Value> result;
+            thread::id owner;
+        };
+        vector<pending_computation> computing;
+
+        // 链表数 n = 2^level + split，下标小于split的链表已经分裂过，要多用一位哈希
+        static size_t chain_index(chain_array const & c, size_t h) {
+            size_t const n = c.count.load(memory_order_acquire);
+            size_t const low = bit_floor(n);
+            size_t index = h & (low - 1);
+            if (index < n - low) {
+                index = h & (2 * low - 1);
+            }
+            return index;
+        }
+
+        void begin_restructure() {
+            restructure_seq.store(restructure_seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+        }
+        void end_restructure() {
+            restructure_seq.store(restructure_seq.load(memory_order_relaxed) + 1, memory_order_release);
+        }
+
+        // 把下标为n - 2^level的链表中哈希第level位为1的节点挪到新链表n上，只重新链接，不分配节点。
+        // 两条链表都保持原来的相对顺序，next只会指向原链表中更靠后的节点，正在遍历的读者不会进入环
+        void split() {
+            chain_array * c = chains.load(memory_order_relaxed);
+            size_t const n = c->count.load(memory_order_relaxed);
+            size_t const low = bit_floor(n);
+            begin_restructure();
+            if (n == c->heads.size()) {
+                chain_array * const bigger = new chain_array(n * 2, n);
+                for (size_t i = 0; i < n; ++i) {
+                    bigger->heads[i].store(c->heads[i].load(memory_order_relaxed), memory_order_relaxed);
+                }
+                chains.store(bigger, memory_order_release);
+                epoch_domain::retire(c);
+                c = bigger;
+            }
+            atomic<node *> * stay_link = &c->heads[n - low];
+            node * moved_head = nullptr;
+            node * moved_tail = nullptr;
+            for (node * p = stay_link->load(memory_order_relaxed); p;) {
+                node * const next = p->next.load(memory_order_relaxed);
+                if (p->hash & low) {
+                    if (moved_tail) {
+                        moved_tail->next.store(p, memory_order_release);
+                    } else {
+                        moved_head = p;
+                    }
+                    moved_tail = p;
+                } else {
+                    stay_link->store(p, memory_order_release);
+                    stay_link = &p->next;
+                }
+                p = next;
+            }
+            stay_link->store(nullptr, memory_order_release);
+            if (moved_tail) {
+                moved_tail->next.store(nullptr, memory_order_release);
+            }
+            c->heads[n].store(moved_head, memory_order_release);
+            c->count.store(n + 1, memory_order_release);
+            end_restructure();
+        }
+
+        // split的逆操作，把最后一条链表接到它分裂出来的那条链表末尾
+        void merge() {
+            chain_array * const c = chains.load(memory_order_relaxed);
+            size_t const last = c->count.load(memory_order_relaxed) - 1;
+            begin_restructure();
+            atomic<node *> * link = &c->heads[last - bit_floor(last)];
+            while (node * const p = link->load(memory_order_relaxed)) {
+                link = &p->next;
+            }
+            link->store(c->heads[last].load(memory_order_relaxed), memory_order_release);
+            c->count.store(last, memory_order_release);
+            c->heads[last].store(nullptr, memory_order_relaxed);
+            end_restructure();
+        }
+    };
+
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using hash_type = Hash;
+    thread_safe_lookup_table(unsigned num_buckets = 19, Hash const & hasher_ = Hash()) : buckets(num_buckets), hasher(hasher_) {
+        for (auto i = 0; i < num_buckets; ++i) {
+            buckets[i].reset(new bucket_type(snapshots));
+        }
+    }
+    thread_safe_lookup_table(thread_safe_lookup_table const & other) = delete;
+    thread_safe_lookup_table & operator=(thread_safe_lookup_table const & other) = delete;
+
+    Value value_for(Key const & key, Value const & default_value = Value()) const {
+        size_t const h = hasher(key);
+        return get_bucket(h).value_for(key, chain_hash(h), default_value);
+    }
+
+    // 和value_for一样不加锁，但能区分键不存在的情况
+    optional<Value> find(Key const & key) const {
+        size_t const h = hasher(key);
+        epoch_domain::guard guard;
+        node const * const p = get_bucket(h).find(key, chain_hash(h));
+        return p ? optional<Value>(p->value.second) : nullopt;
+    }
+
+    void add_or_update_mapping(Key const & key, Value const & value) {
+        size_t const h = hasher(key);
+        get_bucket(h).add_or_update_mapping(key, chain_hash(h), value);
+    }
+    void remove_mapping(Key const & key) {
+        size_t const h = hasher(key);
+        get_bucket(h).remove_mapping(key, chain_hash(h));
+    }
+
+    // 以下几个操作各自只在桶的锁内查找一次链表，不会像先value_for再add_or_update_mapping那样丢失更新
+
+    // 键不存在时插入init；存在时在当前值的副本上调用fn(Value &)，再换上修改后的值。返回操作之后的值
+    // fn抛出异常时表保持不变
+    template <typename Function>
+    Value upsert(Key const & key, Value const & init, Function fn) {
+        size_t const h = hasher(key);
+        size_t const ch = chain_hash(h);
+        bucket_type & bucket = get_bucket(h);
+        lock_guard<mutex> lock(bucket.write_mutex);
+        if (atomic<node *> * const link = bucket.find_link(key, ch)) {
+            Value value = link->load(memory_order_relaxed)->value.second;
+            fn(value);
+            bucket.replace_locked(*link, value);
+            return value;
+        }
+        bucket.insert_locked(key, ch, init);
+        return init;
+    }
+
+    // 键存在时和upsert一样修改它的值，返回键是否存在
+    template <typename Function>
+    bool compute_if_present(Key const & key, Function fn) {
+        size_t const h = hasher(key);
+        size_t const ch = chain_hash(h);
+        bucket_type & bucket = get_bucket(h);
+        lock_guard<mutex> lock(bucket.write_mutex);
+        atomic<node *> * const link = bucket.find_link(key, ch);
+        if (!link) {
+            return false;
+        }
+        Value value = link->load(memory_order_relaxed)->value.second;
+        fn(value);
+        bucket.replace_locked(*link, move(value));
+        return true;
+    }
+
+    // 键不存在时用args构造值并插入，返回是否插入；键已经存在时不构造值
+    template <typename... Args>
+    bool try_emplace(Key const & key, Args &&... args) {
+        size_t const h = hasher(key);
+        size_t const ch = chain_hash(h);
+        bucket_type & bucket = get_bucket(h);
+        lock_guard<mutex> lock(bucket.write_mutex);
+        if (bucket.find_link(key, ch)) {
+            return false;
+        }
+        bucket.insert_locked(key, ch, Value(forward<Args>(args)...));
+        return true;
+    }
+
+    // 返回键的值，键不存在时调用fn()计算出值并插入
+    // 很多线程同时没找到同一个键时只有一个线程调用fn，其他线程等待它的结果，不会重复计算；
+    // fn在桶的锁外执行，不会挡住同一个桶里其他键的读写。
+    // fn抛出异常时正在等待的线程也会得到这个异常，之后的调用重新计算。
+    // fn不能再对同一个键调用get_or_compute：那样会等待自己的结果，这种情况抛出logic_error；
+    // 两个线程的fn互相等待对方的键同样会死锁，但无法检测
+    template <typename Function>
+    Value get_or_compute(Key const & key, Function fn) {
+        size_t const h = hasher(key);
+        size_t const ch = chain_hash(h);
+        bucket_type & bucket = get_bucket(h);
+        {
+            epoch_domain::guard guard;
+            if (node const * const p = bucket.find(key, ch)) {
+                return p->value.second;
+            }
+        }
+        unique_lock<mutex> lock(bucket.write_mutex);
+        if (atomic<node *> * const link = bucket.find_link(key, ch)) {
+            return link->load(memory_order_relaxed)->value.second;
+        }
+        for (auto const & pending : bucket.computing) {
+            if (pending.key == key) {
+                if (pending.owner == this_thread::get_id()) {
+                    throw logic_error("get_or_compute: fn must not call get_or_compute for the key it is computing");
+                }
+                shared_future<Value> const result = pending.result;
+                lock.unlock();
+                return result.get();
+            }
+        }
+        promise<Value> result;
+        bucket.computing.push_back({key, result.get_future().share(), this_thread::get_id()});
+        lock.unlock();
+        optional<Value> value;
+        try {
+            value.emplace(fn());
+        } catch (...) {
+            lock.lock();
+            bucket.finish_computing(key);
+            lock.unlock();
+            result.set_exception(current_exception());
+            throw;
+        }
+        lock.lock();
+        // 计算期间可能有人直接写入了这个键，以写入的值为准
+        if (atomic<node *> * const link = bucket.find_link(key, ch)) {
+            value = link->load(memory_order_relaxed)->value.second;
+        } else {
+            bucket.insert_locked(key, ch, *value);
+        }
+        bucket.finish_computing(key);
+        lock.unlock();
+        result.set_value(*value);
+        return move(*value);
+    }
+
+    // 批量查找，out[i]是keys[i]对应的值(找不到时为default_value)，out至少和keys一样长
+    // 逐个调用value_for时每个键都是一串前后依赖的缓存未命中(桶 -> 链表头数组 -> 链表头 -> 节点)；
+    // 这里先算出所有哈希，一轮一轮地预取同一层的数据，让各个键的未命中重叠起来，整批只进入一次epoch临界区
+    void multi_get(span<Key const> keys, span<Value> out, Value const & default_value = Value()) const {
+        vector<size_t> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            hashes[i] = hasher(keys[i]);
+            prefetch(buckets[hashes[i] % buckets.size()].get());
+        }
+        epoch_domain::guard guard;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            get_bucket(hashes[i]).prefetch_head(chain_hash(hashes[i]));
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            get_bucket(hashes[i]).prefetch_first_node(chain_hash(hashes[i]));
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            node const * const p = get_bucket(hashes[i]).find(keys[i], chain_hash(hashes[i]));
+            out[i] = p ? p->value.second : default_value;
+        }
+    }
+
+    // 批量写入，按桶分组(组内保持原来的顺序，同一个键以最后一次为准)，每个桶只上一次锁
+    void multi_put(span<pair<Key, Value> const> entries) {
+        vector<size_t> hashes(entries.size());
+        vector<size_t> order(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            hashes[i] = hasher(entries[i].first);
+            prefetch(buckets[hashes[i] % buckets.size()].get());
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return hashes[lhs] % buckets.size() < hashes[rhs] % buckets.size();
+        });
+        for (size_t first = 0; first < order.size();) {
+            bucket_type & bucket = get_bucket(hashes[order[first]]);
+            lock_guard<mutex> lock(bucket.write_mutex);
+            size_t last = first;
+            for (; last < order.size() && &get_bucket(hashes[order[last]]) == &bucket; ++last) {
+                pair<Key, Value> const & entry = entries[order[last]];
+                bucket.update_locked(entry.first, chain_hash(hashes[order[last]]), entry.second);
+            }
+            first = last;
+        }
+    }
+
+    // 只是一个瞬时快照
+    size_t size() const {
+        size_t res = 0;
+        for (unsigned int i = 0; i < buckets.size(); i++) {
+            res += buckets[i]->size();
+        }
+        return res;
+    }
+
+    // 查询表的一个“可有可无”(nice-to-have)的特性，会将选择当前状态的快照，例如，一个std::map<>
+    // 这将要求锁住整个容器，用来保证拷贝副本的状态是可以索引的，这将要求锁住所有的桶。因为对于查询表的“普通”的操作，
+    // 需要在同一时间获取一个桶上的一个锁，而这个操作将要求查询表将所有桶都锁住。因此，只要每次以相同的顺序进行上锁(例如，递增桶的索引值)，就不会产生死锁。
+    // 现在基于snapshot()实现，不再同时锁住所有的桶
+    map<Key,Value> get_map() const {
+        vector<pair<Key, Value>> const entries = snapshot();
+        return map<Key, Value>(entries.begin(), entries.end());
+    }
+
+    // 一致的快照，写成一个平坦的vector，不要求键可以比较大小；sorted_snapshot()再按键排序
+    // 不需要锁住所有的桶(写时复制)：先发布一个新的快照编号，然后逐个桶上锁拷贝，每次只锁一个桶；
+    // 在此期间写者要修改一个还没拷贝过的桶时，先把这个桶修改之前的内容拷进快照再修改。
+    // 写者最多因为拷贝自己要写的那一个桶而等待，其他桶的读写都不受影响。
+    // 每个写者在桶锁内、修改之前读一次快照编号，由它决定这次写算在快照之前还是之后：读到旧编号的写整个算在快照里，
+    // 即使它在编号发布之后才完成；读到新编号的写整个不算。所以快照不是编号发布那一瞬间的精确状态，而是一个一致的切面：
+    // 调用之前已经完成的写都在里面，编号发布之后才开始的写都不在，一个写被包含时，先于它发生(happens-before)的写也都被包含
+    vector<pair<Key, Value>> snapshot() const {
+        vector<bucket_value> res;
+        {
+            lock_guard<mutex> snapshot_lock(snapshots.snapshot_mutex);
+            {
+                lock_guard<mutex> lock(snapshots.entries_mutex);
+                snapshots.entries = &res;
+            }
+            uint64_t const id = ++snapshots.last_id;
+            snapshots.active_id.store(id, memory_order_release);
+            for (unsigned int i = 0; i < buckets.size(); i++) {
+                lock_guard<mutex> lock(buckets[i]->write_mutex);
+                if (buckets[i]->captured_snapshot != id) {
+                    buckets[i]->capture(id);
+                }
+            }
+            // 所有桶都已经拷贝过，之后的写者不会再访问entries
+            lock_guard<mutex> lock(snapshots.entries_mutex);
+            snapshots.entries = nullptr;
+        }
+        return res;
+    }
+
+    // 按键排序的快照，只有这个版本要求Key支持operator<
+    vector<pair<Key, Value>> sorted_snapshot() const {
+        vector<pair<Key, Value>> res = snapshot();
+        sort(res.begin(), res.end(), [](pair<Key, Value> const & lhs, pair<Key, Value> const & rhs) {
+            return lhs.first < rhs.first;
+        });
+        return res;
+    }
+
+private:
+    mutable snapshot_state snapshots;
+    vector<unique_ptr<bucket_type>> buckets;
+    Hash hasher;
+    bucket_type & get_bucket(size_t h) const {
+        size_t const bucket_index = h % buckets.size();
+        return *buckets[bucket_index];
+    }
+    // 桶内选链表用去掉桶下标之后剩下的哈希值，和选桶用的部分互不相关
+    size_t chain_hash(size_t h) const {
+        return h / buckets.size();
+    }
+};
+
+// 开放寻址(open addressing)的查询表，接口和thread_safe_lookup_table一样
+// 链表桶每查一个元素都要跳一次堆上的节点；这里所有元素直接存放在连续的槽数组里，用线性探测解决冲突，
+// 一次查找通常只访问一到两个缓存行。
+// 槽数组按哈希值分成若干段(segment)，每段有自己的读写锁(锁分段，lock striping)，探测只在段内进行；
+// 段的装载率超过3/4时，只把这一段的容量加倍，其他段不受影响。
+// 删除使用后移(backward shift)：把后面探测链上的元素往前挪来填补空位，不留墓碑(tombstone)，探测链不会越来越长
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class open_addressing_lookup_table {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using hash_type = Hash;
+
+    explicit open_addressing_lookup_table(size_t capacity = 1024, unsigned num_segments = 16, Hash const & hasher = Hash())
+        : _num_segments(round_up_pow2(max(1u, num_segments))),
+          _segments(new segment[_num_segments]),
+          _hasher(hasher) {
+        size_t const per_segment = round_up_pow2(max<size_t>(min_segment_capacity, capacity / _num_segments * 4 / 3 + 1));
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            _segments[i].slots.resize(per_segment);
+        }
+    }
+    open_addressing_lookup_table(open_addressing_lookup_table const & other) = delete;
+    open_addressing_lookup_table & operator=(open_addressing_lookup_table const & other) = delete;
+
+    Value value_for(Key const & key, Value const & default_value = Value()) const {
+        size_t const h = hash_of(key);
+        segment const & seg = segment_for(h);
+        shared_lock<shared_mutex> lock(seg.sh_mutex);
+        size_t const index = seg.find(key, h);
+        return index == npos ? default_value : seg.slots[index].data->second;
+    }
+
+    void add_or_update_mapping(Key const & key, Value const & value) {
+        size_t const h = hash_of(key);
+        segment & seg = segment_for(h);
+        unique_lock<shared_mutex> lock(seg.sh_mutex);
+        size_t const index = seg.find(key, h);
+        if (index != npos) {
+            seg.slots[index].data->second = value;
+            return;
+        }
+        if ((seg.size + 1) * 4 > seg.slots.size() * 3) {
+            seg.grow();
+        }
+        seg.insert(h, bucket_value(key, value));
+    }
+
+    void remove_mapping(Key const & key) {
+        size_t const h = hash_of(key);
+        segment & seg = segment_for(h);
+        unique_lock<shared_mutex> lock(seg.sh_mutex);
+        size_t const index = seg.find(key, h);
+        if (index != npos) {
+            seg.erase(index);
+        }
+    }
+
+    // 和thread_safe_lookup_table::get_map一样按段的顺序上锁，只需要共享锁
+    map<Key, Value> get_map() const {
+        vector<shared_lock<shared_mutex>> locks;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            locks.push_back(shared_lock<shared_mutex>(_segments[i].sh_mutex));
+        }
+        map<Key, Value> res;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            for (slot const & s : _segments[i].slots) {
+                if (s.data) {
+                    res.insert(*s.data);
+                }
+            }
+        }
+        return res;
+    }
+
+    // 只是一个瞬时快照
+    size_t size() const {
+        size_t res = 0;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            shared_lock<shared_mutex> lock(_segments[i].sh_mutex);
+            res += _segments[i].size;
+        }
+        return res;
+    }
+
+private:
+    using bucket_value = pair<Key, Value>;
+
+    static constexpr size_t npos = size_t(-1);
+    static constexpr size_t min_segment_capacity = 8;
+
+    // 保存完整的哈希值：比较键之前先比较哈希，扩容和后移时也不用重新计算
+    struct slot {
+        size_t hash = 0;
+        optional<bucket_value> data;
+    };
+
+    struct alignas(cache_line_size) segment {
+        mutable shared_mutex sh_mutex;
+        vector<slot> slots;
+        size_t size = 0;
+
+        size_t mask() const {
+            return slots.size() - 1;
+        }
+
+        // 装载率不超过3/4，探测总会遇到空槽
+        size_t find(Key const & key, size_t h) const {
+            for (size_t i = h & mask(); slots[i].data; i = (i + 1) & mask()) {
+                if (slots[i].hash == h && slots[i].data->first == key) {
+                    return i;
+                }
+            }
+            return npos;
+        }
+
+        void insert(size_t h, bucket_value && value) {
+            size_t i = h & mask();
+            while (slots[i].data) {
+                i = (i + 1) & mask();
+            }
+            slots[i].hash = h;
+            slots[i].data.emplace(move(value));
+            ++size;
+        }
+
+        // 从hole往后扫描探测链，初始位置不在(hole, j]之间的元素可以挪到hole，挪走后j成为新的hole
+        void erase(size_t hole) {
+            for (size_t j = (hole + 1) & mask(); slots[j].data; j = (j + 1) & mask()) {
+                size_t const home = slots[j].hash & mask();
+                bool const reachable = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+                if (!reachable) {
+                    slots[hole] = move(slots[j]);
+                    hole = j;
+                }
+            }
+            slots[hole].data.reset();
+            --size;
+        }
+
+        void grow() {
+            vector<slot> old(slots.size() * 2);
+            old.swap(slots);
+            size = 0;
+            for (slot & s : old) {
+                if (s.data) {
+                    insert(s.hash, move(*s.data));
+                }
+            }
+        }
+    };
+
+    unsigned const _num_segments;
+    unique_ptr<segment[]> const _segments;
+    Hash _hasher;
+
+    static size_t round_up_pow2(size_t n) {
+        size_t res = 1;
+        while (res < n) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    // std::hash对整数往往是恒等映射，这里再混合一次(murmur3的fmix64)，保证低位和高位都足够随机
+    size_t hash_of(Key const & key) const {
+        uint64_t h = _hasher(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+
+    // 段号取高32位，段内位置取低位，两者互不相关
+    segment & segment_for(size_t h) const {
+        return _segments[(static_cast<uint64_t>(h) >> 32) & (_num_segments - 1)];
+    }
+};
+
+// Swiss table风格的查询表，接口和thread_safe_lookup_table一样
+// 槽按16个一组(group)，每组有16个字节的控制字节(tag)：空槽是0x80，占用的槽是哈希值的低7位。
+// 查找时一条SSE2指令同时比较一组的16个tag，只有tag相同的槽才去比较键，所以探测长度以组计，通常只看一组；
+// 键比较昂贵(字符串)时也几乎只比较一次。
+// 每组有一把32位的读写自旋锁，读写都只锁住正在看的那一组，一次最多持有一把。
+// 表按哈希分段，段的组数组在epoch_domain的保护下访问，没有段一级的读写锁(每次操作都要改段上共享的读者计数)：
+// 扩容的线程逐个独占旧数组里的组，搬走其中的元素后把组标记为废弃并且不再释放锁，最后发布新数组，旧数组延迟释放。
+// 操作在废弃的组上加锁会失败，等扩容结束后读取新数组重新来过；没有扩容时每次操作只写自己锁住的组。
+// 不使用墓碑(tombstone)：插入时经过已满的组，就在这组的overflow计数里给这个哈希的类别加一，
+// 查找在一组里没找到、并且这一类的overflow计数为0时就可以停止；删除把槽置空之后，再把插入时经过的组的计数减回去，
+// 所以反复增删时探测长度不会越来越长。
+// 同一个键的两个插入者可能都没找到这个键而插进不同的槽：每组有一个插入计数，插入前记下起始组的计数，
+// 占好槽之后加一，期间计数变过(有别的键插入到同一个起始组)就撤销这次插入重新来过
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class swiss_lookup_table {
+public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using hash_type = Hash;
+
+    explicit swiss_lookup_table(size_t capacity = 1024, unsigned num_segments = 16, Hash const & hasher = Hash())
+        : _num_segments(bit_ceil(max(1u, num_segments))),
+          _segments(new segment[_num_segments]),
+          _hasher(hasher) {
+        size_t const groups_per_segment = bit_ceil(capacity / _num_segments * 8 / 7 / group_width + 1);
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            _segments[i].groups.store(new group_array(groups_per_segment), memory_order_relaxed);
+        }
+    }
+    swiss_lookup_table(swiss_lookup_table const & other) = delete;
+    swiss_lookup_table & operator=(swiss_lookup_table const & other) = delete;
+    ~swiss_lookup_table() {
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            delete _segments[i].groups.load(memory_order_relaxed);
+        }
+    }
+
+    Value value_for(Key const & key, Value const & default_value = Value()) const {
+        size_t const h = hash_of(key);
+        segment const & seg = segment_for(h);
+        epoch_domain::guard guard;
+        for (;; seg.wait_for_grow()) {
+            group_array const & arr = seg.current();
+            for (size_t g = arr.home(h), n = 0;; g = (g + 1) & arr.mask(), ++n) {
+                if (n == arr.num_groups) {
+                    return default_value;
+                }
+                group const & grp = arr.groups[g];
+                if (!grp.lock.lock_shared()) {
+                    break;
+                }
+                shared_lock<group_lock> lock(grp.lock, adopt_lock);
+                int const i = grp.find(key, h);
+                if (i >= 0) {
+                    return grp.slots[i]->second;
+                }
+                if (!grp.overflowed(h)) {
+                    return default_value;
+                }
+            }
+        }
+    }
+
+    void add_or_update_mapping(Key const & key, Value const & value) {
+        size_t const h = hash_of(key);
+        segment & seg = segment_for(h);
+        epoch_domain::guard guard;
+        for (;;) {
+            group_array & arr = seg.current();
+            group & home = arr.groups[arr.home(h)];
+            uint32_t const inserts = home.insert_count.load(memory_order_acquire);
+            probe_result const found = update_existing(arr, key, h, value);
+            if (found == probe_result::done) {
+                return;
+            }
+            if (found == probe_result::retired) {
+                seg.wait_for_grow();
+                continue;
+            }
+            // 先占一个名额，保证装载率不超过7/8，下面一定能找到空槽
+            if (seg.size.fetch_add(1, memory_order_relaxed) >= arr.max_size()) {
+                seg.size.fetch_sub(1, memory_order_relaxed);
+                grow(seg, arr);
+                continue;
+            }
+            probe_result const inserted = insert_new(arr, home, inserts, key, h, value);
+            if (inserted == probe_result::done) {
+                return;
+            }
+            seg.size.fetch_sub(1, memory_order_relaxed);
+            if (inserted == probe_result::retired) {
+                seg.wait_for_grow();
+            }
+        }
+    }
+
+    void remove_mapping(Key const & key) {
+        size_t const h = hash_of(key);
+        segment & seg = segment_for(h);
+        epoch_domain::guard guard;
+        for (;; seg.wait_for_grow()) {
+            group_array & arr = seg.current();
+            for (size_t g = arr.home(h), n = 0;; g = (g + 1) & arr.mask(), ++n) {
+                if (n == arr.num_groups) {
+                    return;
+                }
+                group & grp = arr.groups[g];
+                if (!grp.lock.lock()) {
+                    break;
+                }
+                unique_lock<group_lock> lock(grp.lock, adopt_lock);
+                int const i = grp.find(key, h);
+                if (i < 0) {
+                    if (!grp.overflowed(h)) {
+                        return;
+                    }
+                    continue;
+                }
+                grp.tags[i] = empty_tag;
+                grp.slots[i].reset();
+                seg.size.fetch_sub(1, memory_order_relaxed);
+                // 先删除再减计数，期间的查找最多多探测几组；一次只持有一组的锁
+                lock.unlock();
+                release_overflow(arr, h, n);
+                return;
+            }
+        }
+    }
+
+    // 先挡住所有段的扩容，再按顺序锁住所有的组，得到某一时刻的状态
+    map<Key, Value> get_map() const {
+        vector<unique_lock<mutex>> grow_locks;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            grow_locks.emplace_back(_segments[i].grow_mutex);
+        }
+        vector<unique_lock<group_lock>> locks;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            group_array const & arr = *_segments[i].groups.load(memory_order_relaxed);
+            for (size_t g = 0; g < arr.num_groups; ++g) {
+                arr.groups[g].lock.lock();
+                locks.emplace_back(arr.groups[g].lock, adopt_lock);
+            }
+        }
+        map<Key, Value> res;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            group_array const & arr = *_segments[i].groups.load(memory_order_relaxed);
+            for (size_t g = 0; g < arr.num_groups; ++g) {
+                for (optional<bucket_value> const & slot : arr.groups[g].slots) {
+                    if (slot) {
+                        res.insert(*slot);
+                    }
+                }
+            }
+        }
+        return res;
+    }
+
+    // 只是一个瞬时快照
+    size_t size() const {
+        size_t res = 0;
+        for (unsigned i = 0; i < _num_segments; ++i) {
+            res += _segments[i].size.load(memory_order_relaxed);
+        }
+        return res;
+    }
+
+private:
+    using bucket_value = pair<Key, Value>;
+
+    static constexpr unsigned group_width = 16;
+    static constexpr uint8_t empty_tag = 0x80;
+
+    // 组上的读写自旋锁：最高位表示有写者，其余位是读者数。
+    // 写者先占住最高位挡住新来的读者，再等已经进入的读者离开；临界区只有几十条指令，忙等一会儿再让出CPU。
+    // 扩容搬走一组的元素后持有写锁把它废弃(retire)，之后在这组上加锁都返回false
+    class group_lock {
+    public:
+        bool lock_shared() {
+            for (unsigned spins = 0;; ++spins) {
+                uint32_t s = state.load(memory_order_relaxed);
+                if (s == retired) {
+                    return false;
+                }
+                if (!(s & writer) && state.compare_exchange_weak(s, s + 1, memory_order_acquire, memory_order_relaxed)) {
+                    return true;
+                }
+                backoff(spins);
+            }
+        }
+        void unlock_shared() {
+            state.fetch_sub(1, memory_order_release);
+        }
+        bool lock() {
+            for (unsigned spins = 0;; ++spins) {
+                uint32_t s = state.load(memory_order_relaxed);
+                if (s == retired) {
+                    return false;
+                }
+                if (!(s & writer) && state.compare_exchange_weak(s, s | writer, memory_order_acquire, memory_order_relaxed)) {
+                    break;
+                }
+                backoff(spins);
+            }
+            for (unsigned spins = 0; state.load(memory_order_acquire) != writer; ++spins) {
+                backoff(spins);
+            }
+            return true;
+        }
+        void unlock() {
+            state.store(0, memory_order_release);
+        }
+        // 调用者持有写锁
+        void retire() {
+            state.store(retired, memory_order_release);
+        }
+
+    private:
+        static constexpr uint32_t writer = 1u << 31;
+        // 写者位加上读者数的所有位，正常使用时不会出现
+        static constexpr uint32_t retired = ~0u;
+        atomic<uint32_t> state{0};
+
+        static void backoff(unsigned spins) {
+            if (spins < 128) {
+                cpu_relax();
+            } else {
+                this_thread::yield();
+            }
+        }
+    };
+
+    // 哈希最高的3位把元素分成8类，overflow按类计数
+    static constexpr unsigned overflow_classes = 8;
+
+    // tag、锁和overflow在组的第一个缓存行里，槽紧跟在后面
+    struct alignas(cache_line_size) group {
+        alignas(16) uint8_t tags[group_width];
+        mutable group_lock lock;
+        // overflow[c]：插入时经过这一组(当时已满)、放在后面的组里的c类元素个数
+        uint32_t overflow[overflow_classes] = {};
+        atomic<uint32_t> insert_count{0};
+        optional<bucket_value> slots[group_width];
+
+        group() {
+            fill(begin(tags), end(tags), empty_tag);
+        }
+
+        // 第i位为1表示第i个槽的tag等于tag
+        uint32_t match(uint8_t tag) const {
+#ifdef __SSE2__
+            __m128i const ctrl = _mm_load_si128(reinterpret_cast<__m128i const *>(tags));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(tag)))));
+#else
+            uint32_t res = 0;
+            for (unsigned i = 0; i < group_width; ++i) {
+                res |= uint32_t(tags[i] == tag) << i;
+            }
+            return res;
+#endif
+        }
+
+        int find(Key const & key, size_t h) const {
+            for (uint32_t m = match(tag_of(h)); m; m &= m - 1) {
+                int const i = countr_zero(m);
+                if (slots[i]->first == key) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        bool overflowed(size_t h) const {
+            return overflow[overflow_class(h)] != 0;
+        }
+    };
+
+    // 段当前的组数组，扩容时整个换掉
+    struct group_array {
+        unique_ptr<group[]> groups;
+        size_t num_groups;
+
+        explicit group_array(size_t n) : groups(new group[n]), num_groups(n) {}
+
+        size_t mask() const {
+            return num_groups - 1;
+        }
+        // 低7位做tag，起始组用再往上的位
+        size_t home(size_t h) const {
+            return (h >> 7) & mask();
+        }
+        size_t max_size() const {
+            return num_groups * group_width * 7 / 8;
+        }
+    };
+
+    struct alignas(cache_line_size) segment {
+        atomic<group_array *> groups{nullptr};
+        // 包括正在插入的元素占的名额
+        atomic<size_t> size{0};
+        // 只在扩容和get_map时持有
+        mutable mutex grow_mutex;
+
+        // 调用者在epoch临界区内
+        group_array & current() const {
+            return *groups.load(memory_order_acquire);
+        }
+        // 碰到废弃的组说明正在扩容，等它结束再读新数组，不必忙等
+        void wait_for_grow() const {
+            lock_guard<mutex> lock(grow_mutex);
+        }
+    };
+
+    // 一次探测的结果：完成，没找到(或者需要重来)，碰到了扩容废弃的组
+    enum class probe_result {
+        done,
+        missed,
+        retired
+    };
+
+    unsigned const _num_segments;
+    unique_ptr<segment[]> const _segments;
+    Hash _hasher;
+
+    static uint8_t tag_of(size_t h) {
+        return static_cast<uint8_t>(h & 0x7f);
+    }
+    // 用最高的3位，和tag、起始组、段号用的位都不重叠
+    static unsigned overflow_class(size_t h) {
+        return static_cast<unsigned>(static_cast<uint64_t>(h) >> 61);
+    }
+
+    // 和open_addressing_lookup_table一样用fmix64混合一次
+    size_t hash_of(Key const & key) const {
+        uint64_t h = _hasher(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+
+    segment & segment_for(size_t h) const {
+        return _segments[(static_cast<uint64_t>(h) >> 32) & (_num_segments - 1)];
+    }
+
+    // 以下几个函数的调用者都在epoch临界区内
+    probe_result update_existing(group_array & arr, Key const & key, size_t h, Value const & value) {
+        for (size_t g = arr.home(h), n = 0; n < arr.num_groups; g = (g + 1) & arr.mask(), ++n) {
+            group & grp = arr.groups[g];
+            if (!grp.lock.lock()) {
+                return probe_result::retired;
+            }
+            lock_guard<group_lock> lock(grp.lock, adopt_lock);
+            int const i = grp.find(key, h);
+            if (i >= 0) {
+                grp.slots[i]->second = value;
+                return probe_result::done;
+            }
+            if (!grp.overflowed(h)) {
+                break;
+            }
+        }
+        return probe_result::missed;
+    }
+
+    // 调用者已经占了一个名额。从起始组开始找第一个有空槽的组，经过的满组加上overflow计数。
+    // 占好槽之后起始组的插入计数不是inserts，说明可能有人同时插入了同一个键，撤销(包括加过的计数)并返回missed
+    probe_result insert_new(group_array & arr, group & home, uint32_t inserts, Key const & key, size_t h, Value const & value) {
+        for (size_t g = arr.home(h), n = 0;; g = (g + 1) & arr.mask(), ++n) {
+            group & grp = arr.groups[g];
+            if (!grp.lock.lock()) {
+                release_overflow(arr, h, n);
+                return probe_result::retired;
+            }
+            unique_lock<group_lock> lock(grp.lock, adopt_lock);
+            uint32_t const empty = grp.match(empty_tag);
+            if (!empty) {
+                ++grp.overflow[overflow_class(h)];
+                continue;
+            }
+            int const i = countr_zero(empty);
+            grp.tags[i] = tag_of(h);
+            grp.slots[i].emplace(key, value);
+            if (home.insert_count.fetch_add(1, memory_order_acq_rel) == inserts) {
+                return probe_result::done;
+            }
+            grp.tags[i] = empty_tag;
+            grp.slots[i].reset();
+            lock.unlock();
+            release_overflow(arr, h, n);
+            return probe_result::missed;
+        }
+    }
+
+    // 从起始组开始的passed个组，各减去一个元素经过时加上的overflow计数。
+    // 碰到废弃的组就停下：扩容会按搬过去的元素重新计数
+    void release_overflow(group_array & arr, size_t h, size_t passed) {
+        for (size_t g = arr.home(h); passed; g = (g + 1) & arr.mask(), --passed) {
+            group & grp = arr.groups[g];
+            if (!grp.lock.lock()) {
+                return;
+            }
+            lock_guard<group_lock> lock(grp.lock, adopt_lock);
+            --grp.overflow[overflow_class(h)];
+        }
+    }
+
+    // 段里的组数加倍：逐个独占并废弃旧数组里的组，把元素搬到新数组，最后发布新数组，旧数组交给epoch_domain
+    void grow(segment & seg, group_array & seen) {
+        lock_guard<mutex> lock(seg.grow_mutex);
+        group_array * const old = seg.groups.load(memory_order_relaxed);
+        if (old != &seen || seg.size.load(memory_order_relaxed) < old->max_size()) {
+            return;
+        }
+        group_array * const bigger = new group_array(old->num_groups * 2);
+        for (size_t g = 0; g < old->num_groups; ++g) {
+            group & grp = old->groups[g];
+            grp.lock.lock();
+            for (optional<bucket_value> & slot : grp.slots) {
+                if (slot) {
+                    place(*bigger, hash_of(slot->first), move(*slot));
+                }
+            }
+            grp.lock.retire();
+        }
+        seg.groups.store(bigger, memory_order_release);
+        epoch_domain::retire(old);
+    }
+
+    // 新数组还没有发布，只有扩容的线程能访问它
+    void place(group_array & arr, size_t h, bucket_value && value) {
+        for (size_t g = arr.home(h);; g = (g + 1) & arr.mask()) {
+            group & grp = arr.groups[g];
+            uint32_t const empty = grp.match(empty_tag);
+            if (empty) {
+                int const i = countr_zero(empty);
+                grp.tags[i] = tag_of(h);
+                grp.slots[i].emplace(move(value));
+                return;
+            }
+            ++grp.overflow[overflow_class(h)];
+        }
+    }
+};
+
+// open_addressing和swiss两种实现的构造参数：预计的元素个数和分段数。
+// 链式实现的构造参数是桶数(锁的个数)，两者含义不同，用单独的类型区分，不会把桶数当成容量传进来
+struct lookup_table_capacity {
+    size_t entries = 1024;
+    unsigned segments = 16;
+};
+
+// thread_safe_lookup_table的另外两种实现
+template <typename Key, typename Value, typename Hash>
+class thread_safe_lookup_table<Key, Value, Hash, lookup_backend::open_addressing> : public open_addressing_lookup_table<Key, Value, Hash> {
+public:
+    explicit thread_safe_lookup_table(lookup_table_capacity capacity = {}, Hash const & hasher = Hash())
+        : open_addressing_lookup_table<Key, Value, Hash>(capacity.entries, capacity.segments, hasher) {}
+};
+
+template <typename Key, typename Value, typename Hash>
+class thread_safe_lookup_table<Key, Value, Hash, lookup_backend::swiss> : public swiss_lookup_table<Key, Value, Hash> {
+public:
+    explicit thread_safe_lookup_table(lookup_table_capacity capacity = {}, Hash const & hasher = Hash())
+        : swiss_lookup_table<Key, Value, Hash>(capacity.entries, capacity.segments, hasher) {}
+};
+
+// 分散(striped)计数器：每个线程固定加到其中一个独占缓存行的计数上，读取时求和。
+// 很多线程同时计数时不会争用同一个缓存行
+class striped_counter {
+public:
+    void add(uint64_t n = 1) {
+        _stripes[stripe_index()].value.fetch_add(n, memory_order_relaxed);
+    }
+    uint64_t load() const {
+        uint64_t res = 0;
+        for (stripe const & s : _stripes) {
+            res += s.value.load(memory_order_relaxed);
+        }
+        return res;
+    }
+
+private:
+    static constexpr unsigned num_stripes = 16;
+    struct alignas(cache_line_size) stripe {
+        atomic<uint64_t> value{0};
+    };
+    stripe _stripes[num_stripes];
+
+    static unsigned stripe_index() {
+        thread_local unsigned const index = static_cast<unsigned>(hash<thread::id>()(this_thread::get_id()) % num_stripes);
+        return index;
+    }
+};
+
+// 基于thread_safe_lookup_table的有界并发缓存，用分片的CLOCK算法(近似LRU)淘汰
+// 数据放在查询表里，值旁边记着它在CLOCK环上的槽位。命中时只是一次不加锁的查表，再把槽位的访问位置1，
+// 不需要像LRU链表那样在每次命中时加全局锁移动节点。
+// 键按哈希分到若干分片，每个分片有自己的锁、CLOCK环和容量，插入和淘汰只锁一个分片：
+// 指针(hand)扫过访问位为1的槽位时清零(再给一次机会)，遇到为0的槽位就把它淘汰。
+// max_bytes不为0时还按weigher给出的大小限制总字节数(同样分到各个分片)。
+// 两个上限都按分片精确拆分，余数分给前面的分片，各分片加起来正好是上限；分片数不超过max_entries
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class concurrent_cache {
+public:
+    using weigher_type = function<size_t(Key const &, Value const &)>;
+
+    struct cache_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    explicit concurrent_cache(size_t max_entries, size_t max_bytes = 0, weigher_type weigher = weigher_type(),
+                              unsigned num_shards = 16, Hash const & hasher = Hash())
+        : _num_shards(static_cast<unsigned>(min<size_t>(max(1u, num_shards), max<size_t>(1, max_entries)))),
+          _weigher(move(weigher)),
+          _hasher(hasher),
+          _table(_num_shards * 4 + 1, hasher),
+          _shards(new shard[_num_shards]),
+          _referenced(new atomic<uint8_t>[max<size_t>(1, max_entries)]()) {
+        size_t const entries = max<size_t>(1, max_entries);
+        size_t base = 0;
+        for (unsigned i = 0; i < _num_shards; ++i) {
+            shard & sh = _shards[i];
+            sh.base = base;
+            sh.capacity = entries / _num_shards + (i < entries % _num_shards);
+            sh.max_bytes = max_bytes ? max<size_t>(1, max_bytes / _num_shards + (i < max_bytes % _num_shards)) : 0;
+            base += sh.capacity;
+            sh.keys.resize(sh.capacity);
+            sh.charges.resize(sh.capacity);
+            for (size_t j = sh.capacity; j > 0; --j) {
+                sh.free_slots.push_back(j - 1);
+            }
+        }
+    }
+    concurrent_cache(concurrent_cache const & other) = delete;
+    concurrent_cache & operator=(concurrent_cache const & other) = delete;
+
+    optional<Value> get(Key const & key) {
+        if (optional<entry> e = _table.find(key)) {
+            // 槽位可能刚刚被别的键复用，最多让那个键多留一轮，不影响正确性
+            atomic<uint8_t> & ref = _referenced[e->slot];
+            if (!ref.load(memory_order_relaxed)) {
+                ref.store(1, memory_order_relaxed);
+            }
+            _hits.add();
+            return move(e->value);
+        }
+        _misses.add();
+        return nullopt;
+    }
+
+    void put(Key const & key, Value const & value) {
+        size_t const charge = _weigher ? _weigher(key, value) : 1;
+        shard & s = _shards[shard_for(key)];
+        lock_guard<mutex> lock(s.m);
+        size_t slot;
+        // 新插入的元素访问位为0，要再被访问一次才能撑过指针的下一次扫描，只用一次的数据不会挤掉热数据
+        uint8_t referenced = 0;
+        if (optional<entry> e = _table.find(key)) {
+            slot = e->slot - s.base;
+            s.bytes = s.bytes - s.charges[slot] + charge;
+            referenced = 1;
+        } else {
+            if (s.free_slots.empty()) {
+                evict_one(s, s.capacity);
+            }
+            slot = s.free_slots.back();
+            s.free_slots.pop_back();
+            s.keys[slot] = key;
+            s.bytes += charge;
+        }
+        s.charges[slot] = charge;
+        size_t const global_slot = s.base + slot;
+        _referenced[global_slot].store(referenced, memory_order_relaxed);
+        _table.add_or_update_mapping(key, entry{value, global_slot});
+        // 刚写入的元素访问位可能为0，淘汰时跳过它，否则一个超大的新元素会把自己淘汰掉
+        while (s.max_bytes && s.bytes > s.max_bytes && s.free_slots.size() + 1 < s.capacity) {
+            evict_one(s, slot);
+        }
+    }
+
+    bool erase(Key const & key) {
+        shard & s = _shards[shard_for(key)];
+        lock_guard<mutex> lock(s.m);
+        optional<entry> const e = _table.find(key);
+        if (!e) {
+            return false;
+        }
+        release_slot(s, e->slot - s.base);
+        _table.remove_mapping(key);
+        return true;
+    }
+
+    // 计数只是近似的瞬时值
+    cache_stats stats() const {
+        return cache_stats{_hits.load(), _misses.load(), _evictions.load()};
+    }
+
+    size_t size() const {
+        return _table.size();
+    }
+
+private:
+    struct entry {
+        Value value;
+        size_t slot;
+    };
+
+    struct alignas(cache_line_size) shard {
+        mutex m;
+        vector<optional<Key>> keys;
+        vector<size_t> charges;
+        vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        // 分片的第一个槽位在_referenced中的下标，分片的槽位数和字节上限(0表示不限)
+        size_t base = 0;
+        size_t capacity = 0;
+        size_t max_bytes = 0;
+    };
+
+    unsigned const _num_shards;
+    weigher_type const _weigher;
+    Hash _hasher;
+    thread_safe_lookup_table<Key, entry, Hash> _table;
+    unique_ptr<shard[]> const _shards;
+    unique_ptr<atomic<uint8_t>[]> const _referenced;
+    striped_counter _hits;
+    striped_counter _misses;
+    striped_counter _evictions;
+
+    unsigned shard_for(Key const & key) const {
+        return static_cast<unsigned>(_hasher(key) % _num_shards);
+    }
+
+    // 调用者持有s.m
+    void release_slot(shard & s, size_t slot) {
+        s.keys[slot].reset();
+        s.bytes -= s.charges[slot];
+        s.free_slots.push_back(slot);
+    }
+
+    // 调用者持有s.m，分片里至少有一个槽位不是keep的元素(keep为s.capacity时不跳过任何槽位)。
+    // 最多扫两圈：第一圈把访问位都清零了，第二圈一定能找到
+    void evict_one(shard & s, size_t keep) {
+        for (;;) {
+            size_t const slot = s.hand;
+            s.hand = (s.hand + 1) % s.capacity;
+            if (!s.keys[slot] || slot == keep) {
+                continue;
+            }
+            atomic<uint8_t> & ref = _referenced[s.base + slot];
+            if (ref.load(memory_order_relaxed)) {
+                ref.store(0, memory_order_relaxed);
+                continue;
+            }
+            _table.remove_mapping(*s.keys[slot]);
+            release_slot(s, slot);
+            _evictions.add();
+            return;
+        }
     }
 };
 
@@ -0,0 +1,39 @@
+#include "chapter_7.h"
+#include <cstdio>
+
+// 每个线程交替push和pop，统计每秒完成的操作数；总操作数固定，线程多时每个线程做得少
+template <typename Stack>
+static double stack_ops_per_second(unsigned num_threads) {
+    unsigned const total_pairs = 1u << 20;
+    unsigned const pairs_per_thread = total_pairs / num_threads;
+    Stack stack;
+    atomic<bool> go(false);
+    vector<thread> threads;
+    for (unsigned t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&stack, &go, pairs_per_thread] {
+            while (!go.load(memory_order_acquire)) {
+                this_thread::yield();
+            }
+            for (unsigned i = 0; i < pairs_per_thread; ++i) {
+                stack.push(int(i));
+                stack.pop();
+            }
+        });
+    }
+    auto const start = chrono::steady_clock::now();
+    go.store(true, memory_order_release);
+    for (thread & t : threads) {
+        t.join();
+    }
+    chrono::duration<double> const elapsed = chrono::steady_clock::now() - start;
+    return 2.0 * pairs_per_thread * num_threads / elapsed.count();
+}
+
+void elimination_stack_bench(unsigned max_threads) {
+    printf("threads  cas_stack(Mops/s)  elimination(Mops/s)\n");
+    for (unsigned n = 1; n <= max_threads; n *= 2) {
+        double const plain = stack_ops_per_second<lock_free_stack<int>>(n);
+        double const elimination = stack_ops_per_second<elimination_backoff_stack<int>>(n);
+        printf("%7u  %17.2f  %19.2f\n", n, plain / 1e6, elimination / 1e6);
+    }
+}
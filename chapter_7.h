@@ -1,7 +1,10 @@
-#ifndef _CHAPTER_H_
-#define _CHAPTER_H_
+#ifndef _CHAPTER_7_H_
+#define _CHAPTER_7_H_
 
 #include "common.h"
+#include "epoch.h"
+#include "hazard_pointer.h"
+#include "wait_strategy.h"
 
 template <typename T>
 class simple_lock_free_stack {
@@ -43,7 +46,11 @@ public:
 };
 
 
-template <typename T>
+// 节点的回收交给Reclaimer(epoch.h中的epoch_reclamation或者hazard_pointer.h中的hazard_reclamation)。
+// 以前用_thread_in_pop计数，只有没有任何线程在pop()中时才能释放节点，持续有pop的时候_to_be_deleted会无限增长；
+// 基于epoch的回收只要求摘下节点时已经在pop()中的线程都离开，待释放的节点数有上界，pop进入临界区只是一次线程本地的写。
+// 节点在还有线程可能访问它时不会被释放，也就不会被重新分配到同一个地址，CAS _head不会遇到ABA问题
+template <typename T, typename Reclaimer = epoch_reclamation>
 class lock_free_stack {
 private:
     struct node {
@@ -54,75 +61,562 @@ private:
 
     atomic<node *> _head;
 
-    atomic<unsigned> _thread_in_pop;
-    atomic<node *> _to_be_deleted;
+public:
+    lock_free_stack() : _head(nullptr) {}
+    lock_free_stack(lock_free_stack const & other) = delete;
+    lock_free_stack & operator=(lock_free_stack const & other) = delete;
+    ~lock_free_stack() {
+        node * p = _head.load();
+        while (p) {
+            node * const next = p->_next;
+            delete p;
+            p = next;
+        }
+    }
 
-    static void * delete_node(node * nodes) {
-        while (nodes) {
-            node * next = nodes->_next;
-            delete nodes;
-            nodes = next;
+    void push(T const & data) {
+        node * const new_node = new node(data);
+        new_node->_next = _head.load(memory_order_relaxed);
+        while (!_head.compare_exchange_weak(new_node->_next, new_node, memory_order_release, memory_order_relaxed));
+    }
+
+    shared_ptr<T> pop() {
+        typename Reclaimer::guard guard;
+        node * old_head = guard.protect(_head);
+        // CAS失败时old_head变成了新的head，还没有受到保护，需要重新protect
+        while (old_head && !_head.compare_exchange_weak(old_head, old_head->_next, memory_order_acquire, memory_order_relaxed)) {
+            old_head = guard.protect(_head);
+        }
+        shared_ptr<T> res;
+        if (old_head) {
+            res.swap(old_head->_data);
+            Reclaimer::retire(old_head);
         }
+        return res;
     }
+};
+
 
-    void try_reclaim(node * old_head) {
-        if (_thread_in_pop.load() == 1) {
-            node * nodes_to_be_del = _to_be_deleted.exchange(nullptr);
-            if (!--_thread_in_pop) {
-                // 没人pop，直接一个一个删除
-                delete_node(nodes_to_be_del);
-            } else if (nodes_to_be_del) {
-                chain_pending_nodes(nodes_to_be_del);
+// 带版本号(tag)的无锁栈，节点循环使用
+// head是“指针 + 64位版本号”两个字，用一次16字节的CAS整体修改(x86-64上是cmpxchg16b，经由libatomic)，每次修改head版本号都加一，
+// 所以即使同一个节点被弹出又压回来(ABA)，持有旧值的CAS也会因为版本号不同而失败。
+// 版本号不和指针挤在一个字里：不依赖用户态地址只有48位(5级页表、带标记的指针都会用到高位)，64位的版本号实际上也不会回绕。
+// 弹出的节点不释放，放进内部的空闲链表(同样是带版本号的栈)，push优先从这里取节点，
+// 稳定状态下push/pop都不调用全局的分配器；值直接存放在节点里，也不再需要shared_ptr。
+// 节点在栈析构之前不会被释放，pop读到一个已经被别人弹出的节点的next也不会访问非法内存，读到的旧值由版本号排除
+template <typename T>
+class tagged_lock_free_stack {
+private:
+    struct node {
+        atomic<node *> next{nullptr};
+        optional<T> data;
+    };
+
+    // 用带版本号的head串起来的节点链表
+    class alignas(cache_line_size) node_list {
+    public:
+        void push(node * n) {
+            tagged_ptr old = _head.load(memory_order_relaxed);
+            do {
+                n->next.store(old.ptr, memory_order_relaxed);
+            } while (!_head.compare_exchange_weak(old, tagged_ptr{n, old.tag + 1}, memory_order_release, memory_order_relaxed));
+        }
+
+        node * pop() {
+            tagged_ptr old = _head.load(memory_order_acquire);
+            for (;;) {
+                node * const p = old.ptr;
+                if (!p) {
+                    return nullptr;
+                }
+                // p可能已经被别的线程弹出并重新使用，这时读到的next是错的，但版本号已经变了，CAS会失败
+                node * const next = p->next.load(memory_order_relaxed);
+                if (_head.compare_exchange_weak(old, tagged_ptr{next, old.tag + 1}, memory_order_acquire, memory_order_acquire)) {
+                    return p;
+                }
             }
-            delete old_head;
-        } else {
-            chain_pending_nodes(old_head);
-            --_thread_in_pop;
         }
+
+        bool empty() const {
+            return !_head.load(memory_order_acquire).ptr;
+        }
+
+        // 析构时调用，不能和其他操作并发
+        void delete_all() {
+            node * p = _head.load(memory_order_relaxed).ptr;
+            while (p) {
+                node * const next = p->next.load(memory_order_relaxed);
+                delete p;
+                p = next;
+            }
+            _head.store(tagged_ptr{}, memory_order_relaxed);
+        }
+
+    private:
+        // 16字节对齐，CAS才能用一条指令完成
+        struct alignas(16) tagged_ptr {
+            node * ptr = nullptr;
+            uint64_t tag = 0;
+        };
+
+        atomic<tagged_ptr> _head{tagged_ptr{}};
+    };
+
+    node_list _items;
+    node_list _free;
+
+public:
+    tagged_lock_free_stack() = default;
+    tagged_lock_free_stack(tagged_lock_free_stack const & other) = delete;
+    tagged_lock_free_stack & operator=(tagged_lock_free_stack const & other) = delete;
+    ~tagged_lock_free_stack() {
+        _items.delete_all();
+        _free.delete_all();
+    }
+
+    // 预先分配n个空闲节点，之后的前n次push不会再分配内存
+    void reserve(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            _free.push(new node);
+        }
+    }
+
+    void push(T const & value) {
+        emplace(value);
+    }
+    void push(T && value) {
+        emplace(move(value));
+    }
+
+    template <typename... Args>
+    void emplace(Args &&... args) {
+        node * n = _free.pop();
+        if (!n) {
+            n = new node;
+        }
+        try {
+            n->data.emplace(forward<Args>(args)...);
+        } catch (...) {
+            _free.push(n);
+            throw;
+        }
+        _items.push(n);
+    }
+
+    bool pop(T & result) {
+        node * const n = _items.pop();
+        if (!n) {
+            return false;
+        }
+        result = move(*n->data);
+        n->data.reset();
+        _free.push(n);
+        return true;
     }
 
-    void chain_pending_nodes(node * nodes) {
-        node * last = nodes;
-        while (node * const next = last->_next) {
-            last = next;
+    optional<T> pop() {
+        optional<T> res;
+        if (node * const n = _items.pop()) {
+            res.emplace(move(*n->data));
+            n->data.reset();
+            _free.push(n);
         }
-        // [nodes, last]
-        chain_pending_nodes(nodes, last);
+        return res;
     }
 
-    void chain_pending_nodes(node * first, node * last) {
-        last->_next = _to_be_deleted;
-        while (!_to_be_deleted.compare_exchange_weak(last->_next, first));
+    bool empty() const {
+        return _items.empty();
+    }
+};
+
+
+// 带消除(elimination)数组的无锁栈
+// 很多线程同时push/pop时，所有操作都在争用_head这一个CAS。一对同时发生的push和pop其实不需要经过栈：
+// push的值直接交给pop，栈的状态和两个操作先后完成是一样的。
+// 每个操作先尝试一次CAS _head，失败(有竞争)就随机选消除数组里的一个槽，在那里等一小会儿看能不能遇到相反的操作，
+// 遇到了就直接交换，没遇到再回去CAS _head。
+// 每个槽是一个小的状态机(值都是uintptr_t，节点地址至少8字节对齐，最低位可以做标记)：
+//   empty          空闲
+//   pop_waiting    有pop在等待；push用CAS把它换成 节点|1 交给它，pop取走后把槽清空
+//   节点           有push在等待；pop用CAS把它换成taken后拥有这个节点，push看到taken后把槽清空
+// 使用的槽数(宽度)随竞争调整：在槽上等不到对方说明人少，缩小宽度让操作更容易相遇；
+// 选中的槽被别人占着说明人多，扩大宽度
+template <typename T, typename Reclaimer = epoch_reclamation>
+class elimination_backoff_stack {
+private:
+    // 值直接放在节点里，push只有一次内存分配；成对的push/pop很密集时第二次分配(make_shared)的开销比CAS还大
+    struct node {
+        T _data;
+        node * _next;
+        node(T const & data_) : _data(data_) {}
+    };
+
+    static constexpr uintptr_t empty = 0;
+    static constexpr uintptr_t pop_waiting = 1;
+    static constexpr uintptr_t taken = 2;
+    // 在槽上等待的次数，每次一条pause指令
+    static constexpr unsigned wait_spins = 256;
+
+    struct alignas(cache_line_size) slot {
+        atomic<uintptr_t> state{empty};
+    };
+
+    atomic<node *> _head;
+    unsigned const _capacity;
+    unique_ptr<slot[]> const _slots;
+    alignas(cache_line_size) atomic<unsigned> _width;
+
+    slot & random_slot() {
+        thread_local uint32_t seed = static_cast<uint32_t>(hash<thread::id>()(this_thread::get_id())) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return _slots[seed % _width.load(memory_order_relaxed)];
+    }
+
+    void grow() {
+        unsigned w = _width.load(memory_order_relaxed);
+        if (w < _capacity) {
+            _width.compare_exchange_strong(w, w + 1, memory_order_relaxed);
+        }
+    }
+    void shrink() {
+        unsigned w = _width.load(memory_order_relaxed);
+        if (w > 1) {
+            _width.compare_exchange_strong(w, w - 1, memory_order_relaxed);
+        }
+    }
+
+    // 成功交给了一个pop返回true，否则n还属于调用者
+    bool eliminate_push(node * n) {
+        slot & s = random_slot();
+        uintptr_t const mine = reinterpret_cast<uintptr_t>(n);
+        uintptr_t state = s.state.load(memory_order_acquire);
+        if (state == pop_waiting) {
+            return s.state.compare_exchange_strong(state, mine | 1, memory_order_acq_rel, memory_order_relaxed);
+        }
+        if (state != empty || !s.state.compare_exchange_strong(state, mine, memory_order_acq_rel, memory_order_relaxed)) {
+            grow();
+            return false;
+        }
+        for (unsigned i = 0; i < wait_spins; ++i) {
+            if (s.state.load(memory_order_acquire) == taken) {
+                s.state.store(empty, memory_order_release);
+                return true;
+            }
+            cpu_relax();
+        }
+        uintptr_t expected = mine;
+        if (s.state.compare_exchange_strong(expected, empty, memory_order_acq_rel, memory_order_acquire)) {
+            shrink();
+            return false;
+        }
+        // 撤回之前被pop拿走了
+        s.state.store(empty, memory_order_release);
+        return true;
+    }
+
+    // 从一个push那里拿到节点，没有遇到push时返回nullptr
+    node * eliminate_pop() {
+        slot & s = random_slot();
+        uintptr_t state = s.state.load(memory_order_acquire);
+        if (state != empty && state != pop_waiting && state != taken && !(state & 1)) {
+            if (s.state.compare_exchange_strong(state, taken, memory_order_acq_rel, memory_order_relaxed)) {
+                return reinterpret_cast<node *>(state);
+            }
+            return nullptr;
+        }
+        if (state != empty || !s.state.compare_exchange_strong(state, pop_waiting, memory_order_acq_rel, memory_order_relaxed)) {
+            grow();
+            return nullptr;
+        }
+        for (unsigned i = 0; i < wait_spins; ++i) {
+            uintptr_t const handed = s.state.load(memory_order_acquire);
+            if (handed != pop_waiting) {
+                s.state.store(empty, memory_order_release);
+                return reinterpret_cast<node *>(handed & ~uintptr_t(1));
+            }
+            cpu_relax();
+        }
+        uintptr_t expected = pop_waiting;
+        if (s.state.compare_exchange_strong(expected, empty, memory_order_acq_rel, memory_order_acquire)) {
+            shrink();
+            return nullptr;
+        }
+        s.state.store(empty, memory_order_release);
+        return reinterpret_cast<node *>(expected & ~uintptr_t(1));
     }
 
 public:
-    shared_ptr<T> pop() {
-        ++_thread_in_pop;
-        node * old_head = _head.load();
-        while (old_head && !_head.compare_exchange_weak(old_head,old_head->_next));
+    // capacity是消除数组的最大槽数，默认是硬件线程数的一半
+    explicit elimination_backoff_stack(unsigned capacity = max(1u, thread::hardware_concurrency() / 2))
+        : _head(nullptr), _capacity(max(1u, capacity)), _slots(new slot[_capacity]), _width(1) {}
+    elimination_backoff_stack(elimination_backoff_stack const & other) = delete;
+    elimination_backoff_stack & operator=(elimination_backoff_stack const & other) = delete;
+    ~elimination_backoff_stack() {
+        node * p = _head.load();
+        while (p) {
+            node * const next = p->_next;
+            delete p;
+            p = next;
+        }
+    }
+
+    void push(T const & data) {
+        node * const new_node = new node(data);
+        for (;;) {
+            new_node->_next = _head.load(memory_order_relaxed);
+            if (_head.compare_exchange_strong(new_node->_next, new_node, memory_order_release, memory_order_relaxed) ||
+                eliminate_push(new_node)) {
+                return;
+            }
+        }
+    }
+
+    // 摘下节点的CAS成功后只有当前线程会读_data，其他线程最多还在读_next，所以可以直接把值移走
+    optional<T> pop() {
+        for (;;) {
+            {
+                typename Reclaimer::guard guard;
+                node * old_head = guard.protect(_head);
+                if (!old_head) {
+                    return nullopt;
+                }
+                if (_head.compare_exchange_strong(old_head, old_head->_next, memory_order_acquire, memory_order_relaxed)) {
+                    optional<T> res(std::move(old_head->_data));
+                    Reclaimer::retire(old_head);
+                    return res;
+                }
+            }
+            // 通过消除得到的节点从没进过栈，别的线程看不到它，可以直接删除
+            if (node * const n = eliminate_pop()) {
+                optional<T> res(std::move(n->_data));
+                delete n;
+                return res;
+            }
+        }
+    }
+};
+
+// 1到max_threads个线程下lock_free_stack和elimination_backoff_stack的吞吐量，实现在chapter_7.cpp，
+// 运行 concurrency stack_bench [max_threads]
+void elimination_stack_bench(unsigned max_threads = 64);
+
+
+// 7.2.3 使用风险指针(hazard pointer)检测不能被回收的节点
+// 线程在访问一个可能被其他线程删除的节点前，先把节点地址登记到自己的风险指针上；
+// 删除节点的线程发现还有风险指针指向它时，把节点留到稍后再删除。
+// 实现在hazard_pointer.h的hazard_domain中，lock_free_queue和thread/t_stack.h的stack都使用它
+
+// 7.2.4 使用引用计数检测节点：分离引用计数(split reference count)
+// 每个节点有两个计数：外部计数和指向它的指针打包在一起，线程每次读head都先把外部计数加一，
+// 保证读到的节点不会在使用期间被删除；内部计数在节点里，线程用完节点后减一。
+// 把节点从栈上摘下的线程把外部计数减2(head本身和它自己的一次)后加到内部计数上，两者之和为0时节点没有任何人在用，可以删除。
+// 不需要等到没有线程在pop的时刻，也不需要全局的待回收链表，节点在最后一个使用者离开时立即释放。
+// counted_node_ptr和书中一样是{外部计数, 指针}两个字，head用一次16字节的CAS整体修改(x86-64上是cmpxchg16b，经由libatomic)，
+// 不对指针的位宽做任何假设，外部计数也不会回绕。
+// 值直接存放在节点里，pop时移动到optional<T>中返回，不再为每个元素分配shared_ptr<T>
+template <typename T>
+class split_ref_count_stack {
+private:
+    struct node;
+
+    // 计数用64位，结构体没有填充字节：atomic的CAS按字节比较整个对象，填充字节不确定会让CAS无故失败
+    struct alignas(16) counted_node_ptr {
+        int64_t external_count = 0;
+        node * ptr = nullptr;
+    };
+
+    struct node {
+        optional<T> data;
+        atomic<int64_t> internal_count{0};
+        counted_node_ptr next;
+
+        template <typename... Args>
+        explicit node(Args &&... args) : data(in_place, forward<Args>(args)...) {}
+    };
+
+    atomic<counted_node_ptr> _head{counted_node_ptr{}};
+
+    // 把head的外部计数加一，old_counter更新为加一之后的值
+    void increase_head_count(counted_node_ptr & old_counter) {
+        counted_node_ptr new_counter;
+        do {
+            new_counter = old_counter;
+            ++new_counter.external_count;
+        } while (!_head.compare_exchange_strong(old_counter, new_counter, memory_order_acquire, memory_order_relaxed));
+        old_counter = new_counter;
+    }
+
+public:
+    split_ref_count_stack() = default;
+    split_ref_count_stack(split_ref_count_stack const & other) = delete;
+    split_ref_count_stack & operator=(split_ref_count_stack const & other) = delete;
+    ~split_ref_count_stack() {
+        while (pop());
+    }
+
+    void push(T const & value) {
+        emplace(value);
+    }
+    void push(T && value) {
+        emplace(move(value));
+    }
+
+    // 新节点的外部计数为1，代表head对它的引用
+    template <typename... Args>
+    void emplace(Args &&... args) {
+        counted_node_ptr new_head;
+        new_head.external_count = 1;
+        new_head.ptr = new node(forward<Args>(args)...);
+        new_head.ptr->next = _head.load(memory_order_relaxed);
+        while (!_head.compare_exchange_weak(new_head.ptr->next, new_head, memory_order_release, memory_order_relaxed));
+    }
+
+    optional<T> pop() {
+        counted_node_ptr old_head = _head.load(memory_order_relaxed);
+        for (;;) {
+            increase_head_count(old_head);
+            node * const ptr = old_head.ptr;
+            if (!ptr) {
+                return nullopt;
+            }
+            if (_head.compare_exchange_strong(old_head, ptr->next, memory_order_relaxed)) {
+                optional<T> res(move(ptr->data));
+                int64_t const count_increase = old_head.external_count - 2;
+                // 两边都用acq_rel：最后一个减到0的线程负责delete，此前所有线程对节点的访问(读next、移动data)都要发生在delete之前
+                if (ptr->internal_count.fetch_add(count_increase, memory_order_acq_rel) == -count_increase) {
+                    delete ptr;
+                }
+                return res;
+            } else if (ptr->internal_count.fetch_add(-1, memory_order_acq_rel) == 1) {
+                delete ptr;
+            }
+        }
+    }
+
+    bool empty() const {
+        return !_head.load(memory_order_acquire).ptr;
+    }
+};
+
+// 7.2.6 无锁队列(Michael-Scott)
+// 和第6章的virtual_node_queue一样，_head永远指向一个虚拟节点，真正的数据在_head->next中；
+// pop成功后原来的next节点成为新的虚拟节点，旧的虚拟节点交给hazard_domain：
+// 放进本线程的待回收列表，列表够长时才扫描一次所有风险指针，不会每次pop都遍历全局的风险指针和待回收链表。
+// 接口和thread_safe_queue保持一致，两者可以通过typedef直接替换。
+template <typename T>
+class lock_free_queue {
+private:
+    struct node {
+        shared_ptr<T> data;
+        atomic<node *> next;
+        node() : next(nullptr) {}
+    };
+
+    atomic<node *> _head;
+    atomic<node *> _tail;
+
+    shared_ptr<T> pop_head_data() {
+        hazard_domain::holder hp_head(0);
+        hazard_domain::holder hp_next(1);
         shared_ptr<T> res;
-        // assgin value to _to_be_deleted
-        //_to_be_deleted = old_head;
-        if (old_head) {
-            res.swap(old_head->_data);
+        for (;;) {
+            node * old_head = hp_head.protect(_head);
+            node * tail = _tail.load();
+            node * const next = hp_next.protect(old_head->next);
+            // _head没变，说明next仍然在队列中，此时hp_next已经生效
+            if (old_head != _head.load()) {
+                continue;
+            }
+            if (!next) {
+                break;
+            }
+            if (old_head == tail) {
+                // push还没来得及更新_tail，帮它推进
+                _tail.compare_exchange_strong(tail, next);
+                continue;
+            }
+            if (_head.compare_exchange_strong(old_head, next)) {
+                res.swap(next->data);
+                hp_head.reset();
+                hp_next.reset();
+                hazard_domain::retire(old_head);
+                return res;
+            }
         }
-        // 当调用try_reclaim()时，计数器减一，当这个函数被节点调用时，说明这个节点已经被删除4
-        try_reclaim(old_head);  //4
-
-//        node * nodes_to_del = _to_be_deleted.load();
-//        if (!--_thread_in_pop) {
-//            if (_to_be_deleted.compare_exchange_strong(nodes_to_del,nullptr)) {
-//                delete_node(nodes_to_del);
-//            }
-//            delete old_head;
-//        } else if (old_head) {
-//            old_head->_next = nodes_to_del;
-//            while (!_to_be_deleted.compare_exchange_weak(old_head->_next, old_head));
-//        }
         return res;
     }
-};
 
+public:
+    lock_free_queue() : _head(new node), _tail(_head.load()) {}
+    lock_free_queue(const lock_free_queue & other) = delete;
+    lock_free_queue & operator=(const lock_free_queue & other) = delete;
+    ~lock_free_queue() {
+        while (node * const old_head = _head.load()) {
+            _head.store(old_head->next.load());
+            delete old_head;
+        }
+    }
+
+    void push(T new_value) {
+        unique_ptr<node> p(new node);
+        p->data = make_shared<T>(move(new_value));
+        node * const new_node = p.get();
+        hazard_domain::holder hp(0);
+        for (;;) {
+            node * tail = hp.protect(_tail);
+            node * next = tail->next.load();
+            if (tail != _tail.load()) {
+                continue;
+            }
+            if (next) {
+                _tail.compare_exchange_weak(tail, next);
+                continue;
+            }
+            if (tail->next.compare_exchange_weak(next, new_node)) {
+                p.release();
+                _tail.compare_exchange_strong(tail, new_node);
+                break;
+            }
+        }
+    }
+    // 没有条件变量，与push相同，只为和thread_safe_queue接口保持一致
+    void push_cond(T new_value) {
+        push(move(new_value));
+    }
+
+    shared_ptr<T> try_pop() {
+        return pop_head_data();
+    }
+    bool try_pop(T & value) {
+        shared_ptr<T> const res = pop_head_data();
+        if (!res) {
+            return false;
+        }
+        value = move(*res);
+        return true;
+    }
+
+    shared_ptr<T> wait_and_pop() {
+        shared_ptr<T> res;
+        while (!(res = pop_head_data())) {
+            this_thread::yield();
+        }
+        return res;
+    }
+    void wait_and_pop(T & value) {
+        while (!try_pop(value)) {
+            this_thread::yield();
+        }
+    }
+
+    bool empty() {
+        hazard_domain::holder hp(0);
+        node * const old_head = hp.protect(_head);
+        return old_head->next.load() == nullptr;
+    }
+};
 
 
 #endif
\ No newline at end of file
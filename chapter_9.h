@@ -96,25 +96,18 @@ class simple_thread_pool {
     vector<thread> _threads;
     join_threads _joiner;
 
+    // 队列为空时阻塞等待，析构时关闭队列把所有工作线程一次唤醒，剩下的任务执行完后退出，不再轮询_done
     void work_thread() {
-        while (!_done) {
-            function<void()> task;
-            if (_work_queue.try_pop(task)) {
-                task();
-            } else {
-                this_thread::yield();
-            }
+        function<void()> task;
+        while (_work_queue.wait_pop(task) == pop_status::success) {
+            task();
         }
     }
 
     void worker_thread_func() {
-        while (!_done) {
-            function_wrapper _task;
-            if (_func_wrapper_queue_.try_pop(_task)) {
-                _task();
-            } else {
-                this_thread::yield();
-            }
+        function_wrapper _task;
+        while (_func_wrapper_queue_.wait_pop(_task) == pop_status::success) {
+            _task();
         }
     }
 
@@ -136,12 +129,12 @@ public:
                 //_threads.push_back(thread(&simple_thread_pool::thread_local_work,this));
             }
         } catch (...) {
-            _done = true;
+            shutdown();
             throw;
         }
     }
     ~simple_thread_pool() {
-        _done = true;
+        shutdown();
     }
 
     // simple version
@@ -162,6 +155,12 @@ public:
         return res;
     }
 
+    void shutdown() {
+        _done = true;
+        _work_queue.close();
+        _func_wrapper_queue_.close();
+    }
+
     // 9.1.3 for concurrency quick sort
     void run_pending_task() {
         function_wrapper task;
@@ -368,6 +367,50 @@ class steal_thread_pool {
         }
 };
 
+// 按优先级调度的线程池，任务源是松弛优先队列multi_queue
+// 紧急任务不用再排在大量普通任务后面；shards_per_thread和choices的含义见multi_queue
+class priority_thread_pool {
+    using task_type = function_wrapper;
+    multi_queue<task_type, int> _work_queue;
+    vector<thread> _threads;
+    join_threads _joiner;
+
+    void worker_thread() {
+        task_type task;
+        while (_work_queue.wait_pop(task) == pop_status::success) {
+            task();
+        }
+    }
+
+public:
+    explicit priority_thread_pool(unsigned shards_per_thread = 2, unsigned choices = 2)
+        : _work_queue(shards_per_thread, choices), _joiner(_threads) {
+        unsigned const thread_count = thread::hardware_concurrency();
+        try {
+            for (unsigned i = 0; i < thread_count; ++i) {
+                _threads.push_back(thread(&priority_thread_pool::worker_thread, this));
+            }
+        } catch (...) {
+            _work_queue.close();
+            throw;
+        }
+    }
+
+    ~priority_thread_pool() {
+        _work_queue.close();
+    }
+
+    // priority越大越先执行
+    template <typename FunctionType>
+    future<typename result_of<FunctionType()>::type> submit(int priority, FunctionType f) {
+        using result_type = typename result_of<FunctionType()>::type;
+        packaged_task<result_type()> _task(move(f));
+        future<result_type> res(_task.get_future());
+        _work_queue.push(priority, move(_task));
+        return res;
+    }
+};
+
 //////////////////////////// interruptible thread
 class interrupt_flag {
     atomic<bool> _flag;
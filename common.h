@@ -23,7 +23,20 @@
 #include <chrono>
 #include <shared_mutex>
 #include <map>
+#include <new>
+#include <optional>
+#include <cstdint>
+#include <bit>
+#include <span>
 
 using namespace std;
 
+// 缓存行大小，用于对齐/填充共享数据，避免伪共享(false sharing)
+constexpr size_t cache_line_size = 64;
+
+// 软件预取：提前把p所在的缓存行读进缓存，不改变程序语义，p可以是空指针
+inline void prefetch(void const * p) {
+    __builtin_prefetch(p);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,257 @@
+#ifndef __EPOCH_H_
+#define __EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// 基于epoch的内存回收(epoch-based reclamation)
+// 全局有一个递增的epoch，读者进入临界区时把当前epoch登记到自己线程的记录里(一次线程本地的写)，离开时清掉。
+// 从数据结构上摘下的对象不立即释放，而是按摘下时的epoch放进本线程的三个limbo链表之一；
+// 所有仍在临界区内的线程都已经登记了当前epoch时，全局epoch才能加一，
+// 所以epoch前进两次之后，摘下时还可能持有这个对象的读者一定都已经离开了，可以释放。
+// 只要读者不一直停留在临界区内，epoch就会不断前进，待释放的对象数量有上界，不需要等到没有任何线程在读的时刻。
+// 登记和之后的读之间本来需要一个完整的内存屏障；Linux上改由推进epoch的一方调用membarrier，
+// 让进程里所有正在运行的线程都执行一次屏障，读者进入临界区就只剩一次线程本地的写。不支持membarrier时读者自己执行fence
+class epoch_domain {
+    struct retired {
+        void * ptr;
+        void (*deleter)(void *);
+    };
+    struct limbo_list {
+        std::uint64_t epoch = 0;
+        std::vector<retired> items;
+    };
+
+    // 每个线程一条记录，独占缓存行；线程退出后记录留给新线程复用，从不释放
+    struct alignas(64) thread_record {
+        // 在临界区内为 (epoch << 1) | 1，不在临界区内为0
+        std::atomic<std::uint64_t> announced{0};
+        std::atomic<bool> in_use{true};
+        thread_record * next = nullptr;
+        unsigned nesting = 0;
+        unsigned retired_since_collect = 0;
+        limbo_list limbo[3];
+    };
+
+    // 每摘下这么多个对象尝试推进一次epoch并回收
+    static constexpr unsigned collect_interval = 64;
+
+    static inline std::atomic<std::uint64_t> global_epoch{0};
+    static inline std::atomic<thread_record *> records{nullptr};
+
+    struct thread_state {
+        thread_record * record = nullptr;
+        bool exited = false;
+    };
+    struct thread_exit_hook {
+        ~thread_exit_hook() {
+            thread_state & s = state();
+            if (s.record) {
+                release(s.record);
+            }
+            s.record = nullptr;
+            s.exited = true;
+        }
+    };
+
+    // 和node_pool一样，thread_state是平凡析构的，线程退出过程中也可以访问
+    static thread_state & state() {
+        thread_local thread_state s;
+        return s;
+    }
+
+    static thread_record * local() {
+        thread_state & s = state();
+        if (!s.record) {
+            s.record = acquire_record();
+            if (!s.exited) {
+                thread_local thread_exit_hook hook;
+                (void)hook;
+            }
+        }
+        return s.record;
+    }
+
+    // 线程已经退出(其他thread_local对象析构时还在使用)，用完立即交还记录
+    static void release_if_exited(thread_record * r) {
+        thread_state & s = state();
+        if (s.exited && r->nesting == 0) {
+            release(r);
+            s.record = nullptr;
+        }
+    }
+
+    static thread_record * acquire_record() {
+        for (thread_record * r = records.load(std::memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        thread_record * const r = new thread_record;
+        r->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed));
+        return r;
+    }
+
+    // 还没到期的对象留在记录里，由之后复用这条记录的线程释放
+    static void release(thread_record * r) {
+        try_advance();
+        collect(r);
+        r->in_use.store(false, std::memory_order_release);
+    }
+
+    static bool register_membarrier() {
+#if defined(__linux__) && defined(SYS_membarrier)
+        return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#else
+        return false;
+#endif
+    }
+
+    static bool asymmetric_fences() {
+        static bool const supported = register_membarrier();
+        return supported;
+    }
+
+    // 推进epoch一方的屏障，同时替所有读者执行一次
+    static void heavy_fence() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+#if defined(__linux__) && defined(SYS_membarrier)
+        if (asymmetric_fences()) {
+            syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+        }
+#endif
+    }
+
+    static thread_record * enter() {
+        thread_record * const r = local();
+        if (r->nesting++ == 0) {
+            r->announced.store((global_epoch.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+            // 和try_advance中的heavy_fence配对：要么推进epoch的线程看到这次登记，要么这里之后的读看到推进之前所有的摘除
+            if (asymmetric_fences()) {
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            } else {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+        return r;
+    }
+
+    static void leave(thread_record * r) {
+        if (--r->nesting == 0) {
+            r->announced.store(0, std::memory_order_release);
+            release_if_exited(r);
+        }
+    }
+
+    static void free_list(limbo_list & l) {
+        std::vector<retired> items;
+        items.swap(l.items);
+        for (retired const & item : items) {
+            item.deleter(item.ptr);
+        }
+        items.clear();
+        if (l.items.empty()) {
+            l.items.swap(items);
+        }
+    }
+
+    // 摘下时的epoch加2不超过当前epoch的链表可以释放
+    static void collect(thread_record * r) {
+        std::uint64_t const e = global_epoch.load(std::memory_order_acquire);
+        for (limbo_list & l : r->limbo) {
+            if (!l.items.empty() && l.epoch + 2 <= e) {
+                free_list(l);
+            }
+        }
+    }
+
+public:
+    // 读者的临界区，可以嵌套；在guard的生命周期内读到的对象不会被释放
+    class guard {
+    public:
+        guard() : record(enter()) {}
+        ~guard() {
+            leave(record);
+        }
+        guard(guard const &) = delete;
+        guard & operator=(guard const &) = delete;
+
+    private:
+        thread_record * const record;
+    };
+
+    // 所有在临界区内的线程都已经登记了当前epoch时把它加一，返回是否推进成功
+    static bool try_advance() {
+        std::uint64_t e = global_epoch.load(std::memory_order_relaxed);
+        heavy_fence();
+        for (thread_record * r = records.load(std::memory_order_acquire); r; r = r->next) {
+            std::uint64_t const announced = r->announced.load(std::memory_order_relaxed);
+            if ((announced & 1) && (announced >> 1) != e) {
+                return false;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return global_epoch.compare_exchange_strong(e, e + 1, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    // p已经从数据结构上摘下，新的读者不会再看到它；等之前的读者都离开后调用deleter(p)
+    static void retire(void * p, void (*deleter)(void *)) {
+        thread_record * const r = local();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t const e = global_epoch.load(std::memory_order_relaxed);
+        limbo_list & l = r->limbo[e % 3];
+        if (l.epoch != e) {
+            // 同一个位置上次使用时的epoch至少早了3，已经可以释放
+            free_list(l);
+            l.epoch = e;
+        }
+        l.items.push_back(retired{p, deleter});
+        if (++r->retired_since_collect >= collect_interval) {
+            r->retired_since_collect = 0;
+            try_advance();
+            collect(r);
+        }
+        release_if_exited(r);
+    }
+
+    template <typename T>
+    static void retire(T * p) {
+        retire(p, [](void * q) {
+            delete static_cast<T *>(q);
+        });
+    }
+};
+
+// 无锁容器的回收策略(见chapter_7.h的lock_free_stack)，hazard_pointer.h里的hazard_reclamation接口相同：
+//   typename Reclaimer::guard g;   访问共享节点期间持有
+//   g.protect(src)                 读出src中的指针，在g析构或者下一次protect之前可以安全地访问它
+//   Reclaimer::retire(p)           p已经摘下，等到不再有线程可能访问它时delete
+// epoch的guard本身就保护临界区内读到的所有节点，protect只是一次读
+struct epoch_reclamation {
+    class guard {
+    public:
+        template <typename T>
+        T * protect(std::atomic<T *> const & src) {
+            return src.load(std::memory_order_acquire);
+        }
+
+    private:
+        epoch_domain::guard inner;
+    };
+
+    template <typename T>
+    static void retire(T * p) {
+        epoch_domain::retire(p);
+    }
+};
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef __HAZARD_POINTER_H_
+#define __HAZARD_POINTER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// 风险指针(hazard pointer)内存回收
+// 线程访问一个可能被其他线程删除的对象之前，先把对象地址写进自己的风险指针槽(slot)，再确认对象仍然可以访问；
+// 从数据结构上摘下的对象先放进本线程的待回收列表(retire list)，列表长度超过阈值时才扫描一次：
+// 把所有线程的风险指针拷出来排序，列表中不在其中的对象都可以释放，其余的留到下一次。
+// 阈值是风险指针总数的两倍，每次扫描至少释放一半，所以摊还到每个对象上的代价是O(1)，
+// 待回收的对象数也有上界(和epoch_domain不同，一个停在临界区里的线程最多挡住slots_per_thread个对象)。
+// 每个线程一条记录，线程退出后记录留给新线程复用，从不释放
+class hazard_domain {
+public:
+    // 每个线程的风险指针数：无锁队列需要同时保护head和head->next
+    static constexpr unsigned slots_per_thread = 2;
+
+private:
+    struct retired {
+        void * ptr;
+        void (*deleter)(void *);
+    };
+
+    struct alignas(64) thread_record {
+        std::atomic<void *> hazards[slots_per_thread] = {};
+        std::atomic<bool> in_use{true};
+        thread_record * next = nullptr;
+        std::vector<retired> retired_list;
+        // 扫描时拷贝风险指针用，避免每次扫描都分配内存
+        std::vector<void *> snapshot;
+    };
+
+    // 阈值的下限，线程很少时也不要每摘下几个对象就扫描一次
+    static constexpr std::size_t min_scan_threshold = 64;
+
+    static inline std::atomic<thread_record *> records{nullptr};
+    static inline std::atomic<std::size_t> record_count{0};
+
+    // 和epoch_domain一样，thread_state是平凡析构的，线程退出过程中也可以访问
+    // holders是当前线程活着的holder个数，线程退出后要等它们都析构才能交还记录
+    struct thread_state {
+        thread_record * record = nullptr;
+        unsigned holders = 0;
+        bool exited = false;
+    };
+    struct thread_exit_hook {
+        ~thread_exit_hook() {
+            thread_state & s = state();
+            if (s.record) {
+                release(s.record);
+            }
+            s.record = nullptr;
+            s.exited = true;
+        }
+    };
+
+    static thread_state & state() {
+        thread_local thread_state s;
+        return s;
+    }
+
+    static thread_record * local() {
+        thread_state & s = state();
+        if (!s.record) {
+            s.record = acquire_record();
+            if (!s.exited) {
+                thread_local thread_exit_hook hook;
+                (void)hook;
+            }
+        }
+        return s.record;
+    }
+
+    static thread_record * acquire_record() {
+        for (thread_record * r = records.load(std::memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return r;
+            }
+        }
+        thread_record * const r = new thread_record;
+        r->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed));
+        record_count.fetch_add(1, std::memory_order_relaxed);
+        return r;
+    }
+
+    // 还被保护的对象留在记录里，由之后复用这条记录的线程释放
+    static void release(thread_record * r) {
+        for (std::atomic<void *> & hp : r->hazards) {
+            hp.store(nullptr, std::memory_order_release);
+        }
+        scan(r);
+        r->in_use.store(false, std::memory_order_release);
+    }
+
+    // 线程已经退出(其他thread_local对象析构时还在使用)，用完立即交还记录；
+    // 还有holder引用着记录里的槽时不能交还，由最后一个holder析构时交还
+    static void release_if_exited(thread_record * r) {
+        thread_state & s = state();
+        if (s.exited && !s.holders) {
+            release(r);
+            s.record = nullptr;
+        }
+    }
+
+    static std::size_t scan_threshold() {
+        return std::max(min_scan_threshold, 2 * slots_per_thread * record_count.load(std::memory_order_relaxed));
+    }
+
+    static void scan(thread_record * r) {
+        // 和protect中的seq_cst配对：要么这里看到风险指针，要么protect重新读src时看到对象已经被摘下
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::vector<void *> & hazards = r->snapshot;
+        hazards.clear();
+        for (thread_record * p = records.load(std::memory_order_acquire); p; p = p->next) {
+            for (std::atomic<void *> const & hp : p->hazards) {
+                if (void * const q = hp.load(std::memory_order_acquire)) {
+                    hazards.push_back(q);
+                }
+            }
+        }
+        std::sort(hazards.begin(), hazards.end());
+        std::vector<retired> items;
+        items.swap(r->retired_list);
+        for (retired const & item : items) {
+            if (std::binary_search(hazards.begin(), hazards.end(), item.ptr)) {
+                r->retired_list.push_back(item);
+            } else {
+                item.deleter(item.ptr);
+            }
+        }
+    }
+
+public:
+    // 占用当前线程的一个风险指针槽，析构时清空。同一个线程里同一个槽同时只能有一个holder
+    class holder {
+    public:
+        explicit holder(unsigned index = 0) : slot(local()->hazards[index]) {
+            ++state().holders;
+        }
+        ~holder() {
+            reset();
+            // 线程退出后创建的holder可能从来没有调用retire/collect，记录只能在这里交还。
+            // 要等所有holder都析构：release会清空整条记录的槽，lock_free_queue同时持有0号和1号两个holder
+            thread_state & s = state();
+            if (!--s.holders && s.record) {
+                release_if_exited(s.record);
+            }
+        }
+        holder(holder const &) = delete;
+        holder & operator=(holder const &) = delete;
+
+        // 读出src当前的值并保护起来：写入风险指针后重新读一次src，两次相同说明写入时对象还没有被摘下，
+        // 之后它不会被释放，直到reset()或者保护别的对象
+        template <typename T>
+        T * protect(std::atomic<T *> const & src) {
+            T * p = src.load(std::memory_order_relaxed);
+            for (;;) {
+                slot.store(p, std::memory_order_seq_cst);
+                T * const q = src.load(std::memory_order_seq_cst);
+                if (q == p) {
+                    return p;
+                }
+                p = q;
+            }
+        }
+
+        void reset() {
+            slot.store(nullptr, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<void *> & slot;
+    };
+
+    // p已经从数据结构上摘下，新的读者不会再看到它；没有风险指针指向它之后调用deleter(p)
+    static void retire(void * p, void (*deleter)(void *)) {
+        thread_record * const r = local();
+        r->retired_list.push_back(retired{p, deleter});
+        if (r->retired_list.size() >= scan_threshold()) {
+            scan(r);
+        }
+        release_if_exited(r);
+    }
+
+    template <typename T>
+    static void retire(T * p) {
+        retire(p, [](void * q) {
+            delete static_cast<T *>(q);
+        });
+    }
+
+    // 立即扫描一次当前线程的待回收列表
+    static void collect() {
+        thread_record * const r = local();
+        scan(r);
+        release_if_exited(r);
+    }
+};
+
+// 和epoch.h中epoch_reclamation接口相同的回收策略，guard占用当前线程的0号风险指针，只保护最近一次protect得到的节点
+struct hazard_reclamation {
+    class guard {
+    public:
+        template <typename T>
+        T * protect(std::atomic<T *> const & src) {
+            return hp.protect(src);
+        }
+
+    private:
+        hazard_domain::holder hp;
+    };
+
+    template <typename T>
+    static void retire(T * p) {
+        hazard_domain::retire(p);
+    }
+};
+
+#endif
@@ -1,10 +1,16 @@
 #include "common.h"
 #include "chapter_5.h"
 #include "chapter_6.h"
+#include "chapter_7.h"
 #include "chapter_8.h"
 #include "chapter_9.h"
 
-int main() {
+int main(int argc, char ** argv) {
+    // concurrency stack_bench [max_threads]：比较lock_free_stack和elimination_backoff_stack的吞吐量
+    if (argc > 1 && string(argv[1]) == "stack_bench") {
+        elimination_stack_bench(argc > 2 ? stoul(argv[2]) : 64);
+        return 0;
+    }
 
     vector<int> vec(100, 1);
     int init = 0;
@@ -0,0 +1,251 @@
+#ifndef __NODE_POOL_H_
+#define __NODE_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// 固定大小内存块池，给并发队列的节点和shared_ptr控制块使用
+// 每个线程有自己的空闲链表(local_free)，分配/释放自己的块时不需要任何同步；
+// 队列里常见的情况是生产者线程分配、消费者线程释放，这时释放的块会先攒在消费者线程的pending批次里，
+// 攒够batch_size个再用一次CAS整批还给所属线程的remote_free，所属线程在local_free用完时一次性取回。
+// 稳定状态下push/pop循环不再调用malloc/free。
+// 线程退出时池不会被释放，而是放回idle_pools等待新线程接管，其他线程仍然可以把块还给它。
+template <std::size_t BlockSize>
+class node_pool {
+    struct block {
+        block * next;
+    };
+    // 每个块前面的头部记录所属的池
+    struct alignas(alignof(std::max_align_t)) header {
+        node_pool * owner;
+    };
+    struct pending_batch {
+        node_pool * owner;
+        block * first;
+        block * last;
+        std::size_t count;
+    };
+
+    static constexpr std::size_t batch_size = 64;
+    static constexpr std::size_t max_pending_owners = 4;
+    static constexpr std::size_t payload_size = BlockSize < sizeof(block) ? sizeof(block) : BlockSize;
+
+    block * local_free = nullptr;
+    std::atomic<block *> remote_free{nullptr};
+    pending_batch pending[max_pending_owners] = {};
+
+    static inline std::mutex registry_mutex;
+    static inline std::vector<node_pool *> idle_pools;
+
+    struct thread_state {
+        node_pool * pool = nullptr;
+        bool exited = false;
+    };
+    // 线程退出时把攒着的批次还回去，并让出自己的池
+    struct thread_exit_hook {
+        ~thread_exit_hook() {
+            thread_state & s = state();
+            if (s.pool) {
+                s.pool->flush_all();
+                std::lock_guard<std::mutex> lk(registry_mutex);
+                idle_pools.push_back(s.pool);
+            }
+            s.pool = nullptr;
+            s.exited = true;
+        }
+    };
+
+    // thread_state是平凡析构的，线程退出过程中(包括其他thread_local对象析构时)依然可以安全访问
+    static thread_state & state() {
+        thread_local thread_state s;
+        return s;
+    }
+
+    // 线程正在退出时返回nullptr
+    static node_pool * local() {
+        thread_state & s = state();
+        if (!s.pool && !s.exited) {
+            {
+                std::lock_guard<std::mutex> lk(registry_mutex);
+                if (idle_pools.empty()) {
+                    s.pool = new node_pool;
+                } else {
+                    s.pool = idle_pools.back();
+                    idle_pools.pop_back();
+                }
+            }
+            thread_local thread_exit_hook hook;
+            (void)hook;
+        }
+        return s.pool;
+    }
+
+    void push_remote(block * first, block * last) {
+        last->next = remote_free.load(std::memory_order_relaxed);
+        while (!remote_free.compare_exchange_weak(last->next, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void flush(pending_batch & batch) {
+        batch.owner->push_remote(batch.first, batch.last);
+        batch = pending_batch();
+    }
+
+    void flush_all() {
+        for (pending_batch & batch : pending) {
+            if (batch.owner) {
+                flush(batch);
+            }
+        }
+    }
+
+    void defer_remote(node_pool * owner, block * b) {
+        pending_batch * target = nullptr;
+        for (pending_batch & batch : pending) {
+            if (batch.owner == owner) {
+                target = &batch;
+                break;
+            }
+            if (!target && !batch.owner) {
+                target = &batch;
+            }
+        }
+        if (!target) {
+            // 批次槽都被其他池占用了，先把第一个还回去
+            target = &pending[0];
+            flush(*target);
+        }
+        if (!target->owner) {
+            target->owner = owner;
+            target->last = b;
+        }
+        b->next = target->first;
+        target->first = b;
+        if (++target->count >= batch_size) {
+            flush(*target);
+        }
+    }
+
+public:
+    static void * allocate() {
+        node_pool * const p = local();
+        if (p) {
+            if (!p->local_free) {
+                p->local_free = p->remote_free.exchange(nullptr, std::memory_order_acquire);
+            }
+            if (block * const b = p->local_free) {
+                p->local_free = b->next;
+                return b;
+            }
+        }
+        header * const h = static_cast<header *>(::operator new(sizeof(header) + payload_size));
+        h->owner = p;
+        return h + 1;
+    }
+
+    static void deallocate(void * ptr) {
+        node_pool * const owner = (static_cast<header *>(ptr) - 1)->owner;
+        if (!owner) {
+            ::operator delete(static_cast<header *>(ptr) - 1);
+            return;
+        }
+        block * const b = new (ptr) block{nullptr};
+        node_pool * const p = local();
+        if (p == owner) {
+            b->next = p->local_free;
+            p->local_free = b;
+        } else if (p) {
+            p->defer_remote(owner, b);
+        } else {
+            owner->push_remote(b, b);
+        }
+    }
+};
+
+// 基于node_pool的分配器，可以作为队列的分配策略(Alloc模板参数)
+// 无状态，所有实例都相等；单个对象按16字节向上取整分到对应大小的池，数组和超对齐类型直接走operator new
+template <typename T>
+class pool_allocator {
+public:
+    using value_type = T;
+
+    pool_allocator() noexcept {}
+    template <typename U>
+    pool_allocator(pool_allocator<U> const &) noexcept {}
+
+    T * allocate(std::size_t n) {
+        if (alignof(T) > alignof(std::max_align_t)) {
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        }
+        if (n != 1) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T *>(node_pool<size_class>::allocate());
+    }
+
+    void deallocate(T * p, std::size_t n) noexcept {
+        if (alignof(T) > alignof(std::max_align_t)) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        } else if (n != 1) {
+            ::operator delete(p);
+        } else {
+            node_pool<size_class>::deallocate(p);
+        }
+    }
+
+private:
+    static constexpr std::size_t size_class = (sizeof(T) + 15) / 16 * 16;
+};
+
+template <typename T, typename U>
+bool operator==(pool_allocator<T> const &, pool_allocator<U> const &) noexcept {
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(pool_allocator<T> const &, pool_allocator<U> const &) noexcept {
+    return false;
+}
+
+// 队列节点通过分配策略Alloc创建和销毁：allocate之后construct，construct抛出异常时把内存还回去；
+// 策略是无状态的，每次都默认构造一个分配器。deleter可以作为unique_ptr的删除器
+template <typename Node, typename Alloc>
+struct policy_nodes {
+    using node_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    static Node * create() {
+        node_allocator alloc;
+        Node * const p = node_traits::allocate(alloc, 1);
+        try {
+            node_traits::construct(alloc, p);
+        } catch (...) {
+            node_traits::deallocate(alloc, p, 1);
+            throw;
+        }
+        return p;
+    }
+
+    static void destroy(Node * p) {
+        node_allocator alloc;
+        node_traits::destroy(alloc, p);
+        node_traits::deallocate(alloc, p, 1);
+    }
+
+    struct deleter {
+        void operator()(Node * p) const {
+            destroy(p);
+        }
+    };
+};
+
+// 数据和shared_ptr控制块在同一次分配中完成，也走分配策略
+template <typename T, typename Alloc, typename U>
+std::shared_ptr<T> make_policy_shared(Alloc const & alloc, U && value) {
+    return std::allocate_shared<T>(alloc, std::forward<U>(value));
+}
+
+#endif
@@ -15,6 +15,11 @@
 #include <numeric>  //accumulate
 #include <future>
 #include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <new>
 
+//size used to pad shared data onto separate cache lines to avoid false sharing
+constexpr std::size_t cache_line_size = 64;
 
 #endif
\ No newline at end of file
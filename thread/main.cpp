@@ -113,8 +113,20 @@ test_op return_test_op(){
 #include <map>
 #include <atomic>
 using namespace std;
-int main()
+int main(int argc, char ** argv)
 {
+    //"threads bench [max_threads]" runs the lookup_table layout benchmark instead of the demos
+    if(argc > 1 && std::string(argv[1]) == "bench"){
+        lookup_table_bench(argc > 2 ? std::stoul(argv[2]) : 8);
+        return 0;
+    }
+
+    //the producer/consumer handoff of t_thread.cc through the wait-free spsc queue
+    std::thread spsc_p(spsc_producer);
+    std::thread spsc_c(spsc_consumer);
+    spsc_p.join();
+    spsc_c.join();
+
     string ssszhaojx = "abcdefghijklmn";
     ssszhaojx.reserve(ssszhaojx.size());
 
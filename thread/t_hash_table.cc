@@ -0,0 +1,57 @@
+#include "t_hash_table.h"
+#include <chrono>
+#include <cstdio>
+
+//every thread looks up random keys of a small table and updates one key in a hundred, so readers and writers
+//keep hitting neighbouring bucket headers
+template <bucket_layout Layout>
+static double lookups_per_second(unsigned num_threads){
+    unsigned const num_keys = 4096;
+    unsigned const ops_per_thread = 1000000;
+    lookup_table<unsigned,unsigned,std::hash<unsigned>,Layout> table(61);
+    for(unsigned key = 0; key < num_keys; ++key){
+        table.add_or_upadate_mapping(key, key);
+    }
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < num_threads; ++t){
+        threads.emplace_back([&table,&go,t]{
+            std::uint32_t state = 2654435761u * (t + 1);
+            unsigned sum = 0;
+            while(!go.load(std::memory_order_acquire)){
+                std::this_thread::yield();
+            }
+            for(unsigned i = 0; i < ops_per_thread; ++i){
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                unsigned const key = state % num_keys;
+                if(i % 100 == 0){
+                    table.add_or_upadate_mapping(key, i);
+                } else {
+                    sum += table.value_for(key);
+                }
+            }
+            if(sum == 42){
+                std::printf(" ");
+            }
+        });
+    }
+    auto const start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for(auto & t : threads){
+        t.join();
+    }
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+    return double(ops_per_thread) * num_threads / elapsed.count();
+}
+
+void lookup_table_bench(unsigned max_threads){
+    std::printf("threads  separate(Mops/s)  contiguous(Mops/s)\n");
+    for(unsigned n = 1; n <= max_threads; n *= 2){
+        double const separate = lookups_per_second<bucket_layout::separate>(n);
+        double const contiguous = lookups_per_second<bucket_layout::contiguous>(n);
+        std::printf("%7u  %16.2f  %18.2f\n", n, separate / 1e6, contiguous / 1e6);
+    }
+}
@@ -2,8 +2,59 @@
 #define __HASH_TABLE_
 
 #include "common.h"
+#include "../epoch.h"
+#include "../wait_strategy.h"
 
-template <typename Key, typename Value, typename  Hash = std::hash<Key> >
+//how the bucket headers are stored
+enum class bucket_layout{
+    separate,   //every header is its own heap allocation reached through a pointer; neighbours may share a cache line
+    contiguous  //one array of headers aligned to cache_line_size, one header per line and no pointer to follow
+};
+
+//what stats() reports for an instrumented lookup_table
+struct lookup_table_stats{
+    struct bucket_stats{
+        unsigned bucket;
+        std::uint64_t reads;
+        std::uint64_t writes;
+        std::uint64_t lock_waits;   //writes that found the bucket lock taken
+        std::uint64_t wait_ns;      //total time those writes waited
+        std::size_t entries;
+        std::size_t chains;
+        std::size_t longest_chain;
+    };
+
+    std::uint64_t reads = 0;
+    std::uint64_t writes = 0;
+    std::uint64_t lock_waits = 0;
+    std::uint64_t wait_ns = 0;
+    //[i] is the number of chains holding i entries, the last bin counts the longer ones too
+    std::vector<std::uint64_t> chain_length_histogram;
+    //[i] is the number of lookups and writes that compared i nodes, the last bin counts the longer ones too
+    std::vector<std::uint64_t> probe_length_histogram;
+    //[i] is the number of lock waits that took [2^i, 2^(i+1)) nanoseconds
+    std::vector<std::uint64_t> wait_time_histogram;
+    //the buckets with the most reads + writes, hottest first
+    std::vector<bucket_stats> hottest;
+};
+
+//the number of buckets (locks) is fixed at construction, but every bucket holds a growable array of chains.
+//chains are added and removed one at a time by linear hashing: a write splits one chain when the bucket holds more
+//entries than chains and merges one back when it drops below a quarter, so a resize never moves more than one chain
+//and only ever locks the bucket that is being written.
+//readers take no lock: a linked node never changes its key or value (an update links a replacement node), unlinked
+//nodes are retired to epoch_domain, and readers walk the atomic links inside an epoch guard. writers still lock the bucket.
+//a split or merge moves nodes to another chain and can make a concurrent reader miss a key, so each bucket also has a
+//sequence number that is odd while a split/merge is in progress; a reader that did not find its key rechecks it and
+//retries if a split/merge overlapped the walk. a key that was found is always a correct result.
+//a bucket header (lock, sequence number, counters and the first few chain heads) fits in one cache line; with
+//bucket_layout::contiguous the headers are padded to a line each, so writers of one bucket never invalidate the
+//line readers of its neighbour are using.
+//with Instrumented every bucket also counts its reads, writes, lock waits, wait time and probe lengths, which
+//stats() reports. the counters live in an array of their own and every recording call is an "if constexpr", so a
+//table without instrumentation has the same headers and the same code as before.
+template <typename Key, typename Value, typename  Hash = std::hash<Key>, bucket_layout Layout = bucket_layout::contiguous,
+          bool Instrumented = false>
 class lookup_table{
 public:
     typedef Key key_type;
@@ -11,9 +62,17 @@ public:
     typedef Hash hash_type;
 
     lookup_table(unsigned num_buckets = 19, Hash const & hasher_ = Hash())
-        :buckets(num_buckets),hasher(hasher_){
-        for(unsigned i = 0; i < num_buckets; ++i){
-            buckets[i] = new bucket_type;
+        :bucket_count(num_buckets),hasher(hasher_){
+        if(Layout == bucket_layout::contiguous){
+            padded_buckets.reset(new padded_bucket[num_buckets]);
+        } else {
+            buckets.resize(num_buckets);
+            for(unsigned i = 0; i < num_buckets; ++i){
+                buckets[i] = new bucket_type;
+            }
+        }
+        if(Instrumented){
+            counters.reset(new bucket_counters[num_buckets]);
         }
     }
 
@@ -27,68 +86,489 @@ public:
     }
 
     Value value_for(Key const & key, Value const & default_value = Value()) const{
-        bucket_type & bucket = get_bucket(key);
-        std::shared_lock<std::shared_mutex> lock(bucket.mutex);
-        bucket_iterator const found_entry = bucket.find_entry_for(key);
-        return (found_entry == bucket.data.end()) ? default_value : found_entry->second;
+        std::size_t const h = hasher(key);
+        std::size_t const index = bucket_index(h);
+        bucket_type & bucket = bucket_at(index);
+        std::size_t const ch = chain_hash(h);
+        std::size_t probes = 0;
+        epoch_domain::guard guard;
+        for(;;){
+            std::uint32_t const seq = bucket.seq.load(std::memory_order_acquire);
+            chain_view const chains = bucket.view();
+            for(node const * p = chains.heads[chain_index(chains.count, ch)].load(std::memory_order_acquire); p; p = p->next.load(std::memory_order_acquire)){
+                ++probes;
+                if(p->hash == ch && p->value.first == key){
+                    record_access(index, probes, false);
+                    return p->value.second;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(!(seq & 1) && bucket.seq.load(std::memory_order_relaxed) == seq){
+                record_access(index, probes, false);
+                return default_value;
+            }
+        }
     }
 
     void add_or_upadate_mapping(Key const & key,Value const & value){
-        bucket_type & bucket = get_bucket(key);
-        std::unique_lock<std::shared_mutex> lock(bucket.mutex);
-        bucket_iterator const found_entry = bucket.find_entry_for(key);
-        if(found_entry == bucket.data.end()){
-            bucket.data.push_back(bucket_value(key,value));
-        } else {
-            found_entry->second = value;
+        std::size_t const h = hasher(key);
+        std::size_t const index = bucket_index(h);
+        bucket_type & bucket = bucket_at(index);
+        std::size_t const ch = chain_hash(h);
+        lock_bucket(index);
+        std::lock_guard<bucket_lock> lock(bucket.mutex, std::adopt_lock);
+        chain_view const chains = bucket.view();
+        std::atomic<node *> & head = chains.heads[chain_index(chains.count, ch)];
+        std::size_t probes = 0;
+        for(std::atomic<node *> * link = &head; node * const p = link->load(std::memory_order_relaxed); link = &p->next){
+            ++probes;
+            if(p->hash == ch && p->value.first == key){
+                record_access(index, probes, true);
+                capture_before_write(bucket);
+                //readers may still be on the old node, so it is replaced instead of written to
+                link->store(new node(ch, bucket_value(key,value), p->next.load(std::memory_order_relaxed)), std::memory_order_release);
+                epoch_domain::retire(p);
+                return;
+            }
+        }
+        record_access(index, probes, true);
+        capture_before_write(bucket);
+        head.store(new node(ch, bucket_value(key,value), head.load(std::memory_order_relaxed)), std::memory_order_release);
+        if(++bucket.count > chains.count){
+            bucket.split_chain();
         }
     }
 
     void remove_mapping(Key const & key){
-        bucket_type & bucket = get_bucket(key);
-        std::unique_lock<std::shared_mutex> lock(bucket.mutex);
-        bucket_iterator const found_entry = bucket.find_entry_for(key);
-        if(found_entry != bucket.data.end()){
-            bucket.data.erase(found_entry);
+        std::size_t const h = hasher(key);
+        std::size_t const index = bucket_index(h);
+        bucket_type & bucket = bucket_at(index);
+        std::size_t const ch = chain_hash(h);
+        lock_bucket(index);
+        std::lock_guard<bucket_lock> lock(bucket.mutex, std::adopt_lock);
+        chain_view const chains = bucket.view();
+        std::size_t probes = 0;
+        for(std::atomic<node *> * link = &chains.heads[chain_index(chains.count, ch)]; node * const p = link->load(std::memory_order_relaxed); link = &p->next){
+            ++probes;
+            if(p->hash == ch && p->value.first == key){
+                record_access(index, probes, true);
+                capture_before_write(bucket);
+                //p->next is left alone so a reader standing on p can carry on
+                link->store(p->next.load(std::memory_order_relaxed), std::memory_order_release);
+                epoch_domain::retire(p);
+                if(--bucket.count * 4 < chains.count && chains.count > 1){
+                    bucket.merge();
+                }
+                return;
+            }
         }
+        record_access(index, probes, true);
+    }
+
+    std::size_t size() const{
+        std::size_t res = 0;
+        for(unsigned i = 0; i < bucket_count; ++i){
+            bucket_type & bucket = bucket_at(i);
+            std::lock_guard<bucket_lock> lock(bucket.mutex);
+            res += bucket.count;
+        }
+        return res;
     }
 
     std::map<Key,Value> get_map() const{
-        std::vector<std::unique_lock<std::shared_mutex> > locks;
-        for(unsigned i = 0; i < buckets.size(); ++i){
-            locks.push_back(std::unique_lock<std::shared_mutex>(buckets[i].mutex));
+        std::vector<std::pair<Key,Value> > const entries = snapshot();
+        return std::map<Key,Value>(entries.begin(), entries.end());
+    }
+
+    //a consistent copy of the whole table as a flat vector; Key needs no ordering here, see sorted_snapshot().
+    //the buckets are copied one at a time under their own lock (copy-on-write): a new snapshot id is published first,
+    //and a writer about to change a bucket that has not been copied yet copies its old contents into the snapshot
+    //before writing. a writer waits for at most the copy of the bucket it writes to; nothing else is blocked.
+    //each writer reads the id once under its bucket lock before writing, and that read decides the side of the snapshot
+    //the write falls on: a write that saw the old id is included even if it completes after the new id is published,
+    //one that saw the new id is left out. so the copy is not the table at the exact moment of publication but a
+    //consistent cut: every write completed before the call is in it, no write started after the publication is, and
+    //an included write brings along every write that happens-before it.
+    std::vector<std::pair<Key,Value> > snapshot() const{
+        std::vector<bucket_value> res;
+        {
+            std::lock_guard<std::mutex> snapshot_lock(snapshots.snapshot_mutex);
+            {
+                std::lock_guard<std::mutex> lock(snapshots.entries_mutex);
+                snapshots.entries = &res;
+            }
+            std::uint64_t const id = ++snapshots.last_id;
+            snapshots.active_id.store(id, std::memory_order_release);
+            for(unsigned i = 0; i < bucket_count; ++i){
+                bucket_type & bucket = bucket_at(i);
+                std::lock_guard<bucket_lock> lock(bucket.mutex);
+                if(bucket.captured != id){
+                    capture(bucket, id);
+                }
+            }
+            //every bucket is copied, no writer touches "entries" any more
+            std::lock_guard<std::mutex> lock(snapshots.entries_mutex);
+            snapshots.entries = nullptr;
         }
-        std::map<Key,Value> res;
-        for(unsigned i = 0; i < buckets.size(); ++i){
-            for(bucket_iterator it = buckets[i].data.begin(); it != buckets[i].data.end(); ++it){
-                res.insert(*it);
+        return res;
+    }
+
+    //snapshot() sorted by key, the only version that needs operator< on Key
+    std::vector<std::pair<Key,Value> > sorted_snapshot() const{
+        std::vector<std::pair<Key,Value> > res = snapshot();
+        std::sort(res.begin(),res.end(),[](std::pair<Key,Value> const & lhs, std::pair<Key,Value> const & rhs){return lhs.first < rhs.first;});
+        return res;
+    }
+
+    //only for an instrumented table. the counters are read while the table keeps running, so they are approximate;
+    //the chain lengths are exact for every bucket, each one is walked under its lock
+    lookup_table_stats stats(std::size_t top_n = 8) const{
+        static_assert(Instrumented, "stats() needs a lookup_table with Instrumented = true");
+        lookup_table_stats res;
+        res.chain_length_histogram.assign(chain_length_bins, 0);
+        res.probe_length_histogram.assign(probe_bins, 0);
+        res.wait_time_histogram.assign(wait_bins, 0);
+        std::vector<lookup_table_stats::bucket_stats> all;
+        for(unsigned i = 0; i < bucket_count; ++i){
+            bucket_counters const & c = counters[i];
+            lookup_table_stats::bucket_stats b{};
+            b.bucket = i;
+            b.reads = c.reads.load(std::memory_order_relaxed);
+            b.writes = c.writes.load(std::memory_order_relaxed);
+            b.lock_waits = c.lock_waits.load(std::memory_order_relaxed);
+            b.wait_ns = c.wait_ns.load(std::memory_order_relaxed);
+            {
+                bucket_type & bucket = bucket_at(i);
+                std::lock_guard<bucket_lock> lock(bucket.mutex);
+                chain_view const chains = bucket.view();
+                b.entries = bucket.count;
+                b.chains = chains.count;
+                for(std::size_t j = 0; j < chains.count; ++j){
+                    std::size_t length = 0;
+                    for(node const * p = chains.heads[j].load(std::memory_order_relaxed); p; p = p->next.load(std::memory_order_relaxed)){
+                        ++length;
+                    }
+                    b.longest_chain = std::max(b.longest_chain, length);
+                    ++res.chain_length_histogram[std::min<std::size_t>(length, chain_length_bins - 1)];
+                }
+            }
+            for(unsigned j = 0; j < probe_bins; ++j){
+                res.probe_length_histogram[j] += c.probe_histogram[j].load(std::memory_order_relaxed);
             }
+            for(unsigned j = 0; j < wait_bins; ++j){
+                res.wait_time_histogram[j] += c.wait_histogram[j].load(std::memory_order_relaxed);
+            }
+            res.reads += b.reads;
+            res.writes += b.writes;
+            res.lock_waits += b.lock_waits;
+            res.wait_ns += b.wait_ns;
+            all.push_back(b);
         }
+        top_n = std::min<std::size_t>(top_n, all.size());
+        std::partial_sort(all.begin(), all.begin() + top_n, all.end(),
+            [](lookup_table_stats::bucket_stats const & lhs, lookup_table_stats::bucket_stats const & rhs){
+                std::uint64_t const l = lhs.reads + lhs.writes;
+                std::uint64_t const r = rhs.reads + rhs.writes;
+                return l != r ? l > r : lhs.wait_ns > rhs.wait_ns;
+            });
+        all.resize(top_n);
+        res.hottest = std::move(all);
         return res;
     }
 
 private:
     typedef std::pair<Key,Value> bucket_value;
-    typedef std::list<bucket_value> bucket_data;
-    typedef typename bucket_data::iterator bucket_iterator;
+
+    //the hash is kept so splits never rehash and lookups compare it before the key
+    struct node{
+        std::size_t hash;
+        bucket_value value;
+        std::atomic<node *> next;
+        node(std::size_t hash_, bucket_value const & value_, node * next_):hash(hash_),value(value_),next(next_){}
+    };
+
+    //chain heads of fixed capacity for buckets that outgrew their inline heads; when the chains outgrow it
+    //the array is copied to one twice as large and the old one is retired
+    struct chain_array{
+        std::vector<std::atomic<node *> > heads;
+        std::atomic<std::size_t> count;
+        chain_array(std::size_t capacity, std::size_t count_):heads(capacity),count(count_){}
+    };
+
+    struct chain_view{
+        std::atomic<node *> * heads;
+        std::size_t count;
+    };
+
+    //a 4-byte test-and-test-and-set lock, so the lock shares the header line with the chain heads.
+    //writers hold it for one chain walk (or one split/merge)
+    class bucket_lock{
+    public:
+        bucket_lock():locked(0){}
+        void lock(){
+            unsigned spins = 0;
+            while(locked.exchange(1, std::memory_order_acquire)){
+                while(locked.load(std::memory_order_relaxed)){
+                    if(++spins < 128){
+                        cpu_relax();
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+        }
+        bool try_lock(){
+            return !locked.load(std::memory_order_relaxed) && !locked.exchange(1, std::memory_order_acquire);
+        }
+        void unlock(){
+            locked.store(0, std::memory_order_release);
+        }
+    private:
+        std::atomic<std::uint32_t> locked;
+    };
+
+    static constexpr unsigned chain_length_bins = 16;
+    static constexpr unsigned probe_bins = 16;
+    static constexpr unsigned wait_bins = 40;
+
+    //counters of one bucket for the instrumented table, on lines of their own so that counting a read never
+    //writes to a bucket header
+    struct alignas(cache_line_size) bucket_counters{
+        std::atomic<std::uint64_t> reads{0};
+        std::atomic<std::uint64_t> writes{0};
+        std::atomic<std::uint64_t> lock_waits{0};
+        std::atomic<std::uint64_t> wait_ns{0};
+        std::atomic<std::uint64_t> probe_histogram[probe_bins] = {};
+        std::atomic<std::uint64_t> wait_histogram[wait_bins] = {};
+    };
+
+    //shared state of snapshot()
+    struct snapshot_state{
+        std::mutex snapshot_mutex;
+        std::uint64_t last_id = 0;
+        //id of the running (or last) snapshot; a bucket that recorded a smaller id has not been copied into it yet
+        std::atomic<std::uint64_t> active_id{0};
+        std::mutex entries_mutex;
+        std::vector<bucket_value> * entries = nullptr;
+    };
+
+    //the header line holds the first chain heads rather than the first entries: readers copy key and value out of a
+    //node that never changes, which an entry stored in the header and overwritten in place could not guarantee
+    static constexpr std::size_t inline_chains = 3;
 
     struct bucket_type{
-        bucket_data data;
-        std::shared_mutex mutex;
-        bucket_iterator find_entry_for(Key const & key){
-            return std::find_if(data.begin(),data.end(),[&](bucket_value const & item){return item.first == key;});
+        bucket_lock mutex;
+        std::atomic<std::uint32_t> seq;
+        //nullptr while all chains fit in inline_heads
+        std::atomic<chain_array *> chains;
+        std::atomic<std::size_t> inline_count;
+        std::size_t count;
+        std::uint64_t captured;
+        std::atomic<node *> inline_heads[inline_chains];
+
+        bucket_type():seq(0),chains(nullptr),inline_count(1),count(0),captured(0),inline_heads(){}
+        ~bucket_type(){
+            chain_view const v = view();
+            for(std::size_t i = 0; i < v.count; ++i){
+                node * p = v.heads[i].load(std::memory_order_relaxed);
+                while(p){
+                    node * const next = p->next.load(std::memory_order_relaxed);
+                    delete p;
+                    p = next;
+                }
+            }
+            delete chains.load(std::memory_order_relaxed);
+        }
+
+        //once the chains move out of the header the inline heads are frozen; a reader still looking at them
+        //is caught by the sequence number
+        chain_view view(){
+            if(chain_array * const c = chains.load(std::memory_order_acquire)){
+                return chain_view{c->heads.data(), c->count.load(std::memory_order_acquire)};
+            }
+            return chain_view{inline_heads, inline_count.load(std::memory_order_acquire)};
+        }
+        void publish_count(std::size_t n){
+            if(chain_array * const c = chains.load(std::memory_order_relaxed)){
+                c->count.store(n, std::memory_order_release);
+            } else {
+                inline_count.store(n, std::memory_order_release);
+            }
+        }
+
+        void begin_restructure(){
+            seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        void end_restructure(){
+            seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        //relinks the nodes of chain "n - 2^level" whose hash has bit "level" set into the new chain "n".
+        //both chains keep the original order, so a link only ever moves forward and a concurrent reader cannot loop
+        void split_chain(){
+            chain_view v = view();
+            std::size_t const n = v.count;
+            std::size_t const low = highest_bit(n);
+            begin_restructure();
+            chain_array * const c = chains.load(std::memory_order_relaxed);
+            if(n == (c ? c->heads.size() : inline_chains)){
+                chain_array * const bigger = new chain_array(n * 2, n);
+                for(std::size_t i = 0; i < n; ++i){
+                    bigger->heads[i].store(v.heads[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+                chains.store(bigger, std::memory_order_release);
+                if(c){
+                    epoch_domain::retire(c);
+                }
+                v.heads = bigger->heads.data();
+            }
+            std::atomic<node *> * stay_link = &v.heads[n - low];
+            node * moved_head = nullptr;
+            node * moved_tail = nullptr;
+            for(node * p = stay_link->load(std::memory_order_relaxed); p;){
+                node * const next = p->next.load(std::memory_order_relaxed);
+                if(p->hash & low){
+                    if(moved_tail){
+                        moved_tail->next.store(p, std::memory_order_release);
+                    } else {
+                        moved_head = p;
+                    }
+                    moved_tail = p;
+                } else {
+                    stay_link->store(p, std::memory_order_release);
+                    stay_link = &p->next;
+                }
+                p = next;
+            }
+            stay_link->store(nullptr, std::memory_order_release);
+            if(moved_tail){
+                moved_tail->next.store(nullptr, std::memory_order_release);
+            }
+            v.heads[n].store(moved_head, std::memory_order_release);
+            publish_count(n + 1);
+            end_restructure();
+        }
+
+        //the reverse of split_chain(): the last chain is appended to the one it was split from
+        void merge(){
+            chain_view const v = view();
+            std::size_t const last = v.count - 1;
+            begin_restructure();
+            std::atomic<node *> * link = &v.heads[last - highest_bit(last)];
+            while(node * const p = link->load(std::memory_order_relaxed)){
+                link = &p->next;
+            }
+            link->store(v.heads[last].load(std::memory_order_relaxed), std::memory_order_release);
+            publish_count(last);
+            v.heads[last].store(nullptr, std::memory_order_relaxed);
+            end_restructure();
         }
     };
 
-    bucket_type & get_bucket(Key const & key) const{
-        std::size_t const bucket_index = hasher(key) % buckets.size();
-        return *buckets[bucket_index];
+    static_assert(sizeof(bucket_type) <= cache_line_size, "a bucket header should fit in one cache line");
+
+    struct alignas(cache_line_size) padded_bucket : bucket_type{};
+
+    static std::size_t highest_bit(std::size_t n){
+        std::size_t res = 1;
+        while(res <= n / 2){
+            res <<= 1;
+        }
+        return res;
+    }
+
+    //there are 2^level + split chains, the ones below split have already been split and use one more hash bit
+    static std::size_t chain_index(std::size_t n, std::size_t h){
+        std::size_t const low = highest_bit(n);
+        std::size_t index = h & (low - 1);
+        if(index < n - low){
+            index = h & (2 * low - 1);
+        }
+        return index;
+    }
+
+    //the caller holds bucket.mutex
+    void capture_before_write(bucket_type & bucket) const{
+        std::uint64_t const id = snapshots.active_id.load(std::memory_order_acquire);
+        if(id != bucket.captured){
+            capture(bucket, id);
+        }
+    }
+    void capture(bucket_type & bucket, std::uint64_t id) const{
+        std::lock_guard<std::mutex> lock(snapshots.entries_mutex);
+        chain_view const chains = bucket.view();
+        for(std::size_t i = 0; i < chains.count; ++i){
+            for(node const * p = chains.heads[i].load(std::memory_order_relaxed); p; p = p->next.load(std::memory_order_relaxed)){
+                snapshots.entries->push_back(p->value);
+            }
+        }
+        bucket.captured = id;
     }
 
+    bucket_type & bucket_at(std::size_t index) const{
+        if(Layout == bucket_layout::contiguous){
+            return padded_buckets[index];
+        }
+        return *buckets[index];
+    }
+
+    std::size_t bucket_index(std::size_t h) const{
+        return h % bucket_count;
+    }
+
+    //writers lock through here; the instrumented table first tries the lock and times the wait if it was taken
+    void lock_bucket(std::size_t index) const{
+        bucket_type & bucket = bucket_at(index);
+        if constexpr(Instrumented){
+            if(bucket.mutex.try_lock()){
+                return;
+            }
+            auto const start = std::chrono::steady_clock::now();
+            bucket.mutex.lock();
+            std::uint64_t const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            unsigned bin = 0;
+            while((ns >> bin) > 1 && bin + 1 < wait_bins){
+                ++bin;
+            }
+            bucket_counters & c = counters[index];
+            c.lock_waits.fetch_add(1, std::memory_order_relaxed);
+            c.wait_ns.fetch_add(ns, std::memory_order_relaxed);
+            c.wait_histogram[bin].fetch_add(1, std::memory_order_relaxed);
+        } else {
+            bucket.mutex.lock();
+        }
+    }
+
+    void record_access(std::size_t index, std::size_t probes, bool write) const{
+        if constexpr(Instrumented){
+            bucket_counters & c = counters[index];
+            (write ? c.writes : c.reads).fetch_add(1, std::memory_order_relaxed);
+            c.probe_histogram[std::min<std::size_t>(probes, probe_bins - 1)].fetch_add(1, std::memory_order_relaxed);
+        } else {
+            (void)index;
+            (void)probes;
+            (void)write;
+        }
+    }
+
+    //chains are picked with the part of the hash that is left after picking the bucket
+    std::size_t chain_hash(std::size_t h) const{
+        return h / bucket_count;
+    }
+
+    unsigned const bucket_count;
+    mutable snapshot_state snapshots;
+    std::unique_ptr<padded_bucket[]> padded_buckets;
     std::vector<bucket_type *> buckets;
+    //only allocated with Instrumented
+    std::unique_ptr<bucket_counters[]> counters;
     Hash hasher;
 };
 
+//lookup rate of both layouts under contention, from 1 to max_threads threads
+void lookup_table_bench(unsigned max_threads = 8);
+
 
 
 
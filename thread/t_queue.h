@@ -2,6 +2,8 @@
 #define T_THREAD_QUEUE_H
 
 #include "common.h"
+#include "../node_pool.h"
+#include "../wait_strategy.h"
 
 template <typename  T>
 class t_queue{
@@ -159,10 +161,12 @@ private:
 };
 
 /*a thread-safe queue with fine-grained locking*/
-template <typename T>
+//"Alloc" is the allocation policy for the nodes and the data (std::allocator by default);
+//with pool_allocator a steady-state push/pop loop does no malloc/free. the policy must be stateless.
+template <typename T, typename Alloc = std::allocator<T> >
 class thread_queue{
 public:
-    thread_queue():head(new node),tail(head){}
+    thread_queue():head(node_store::create()),tail(head){}
     thread_queue(const thread_queue &) = delete;
     thread_queue &operator=(const thread_queue &) = delete;
 
@@ -170,7 +174,7 @@ public:
         while(head){
             node * const old = head;
             head = old->next;
-            delete old;
+            node_store::destroy(old);
         }
     }
 
@@ -180,20 +184,24 @@ public:
             return std::shared_ptr<T>();
         }
         std::shared_ptr<T> const res(old->data);
-        delete old;
+        node_store::destroy(old);
         return res;
     }
 
     void push(T new_value){
-        std::shared_ptr<T> new_data(new T(new_value));
-        std::unique_ptr<node> p(new node);
+        std::shared_ptr<T> data(make_policy_shared<T>(Alloc(), std::move(new_value)));
+        node_ptr p(node_store::create());
         std::lock_guard<std::mutex> tail_lock(tail_mutex);
-        tail->data = new_data;
+        tail->data = data;
         tail->next = p.get();
         tail = p.release();
     }
 
 private:
+    struct node;
+    typedef policy_nodes<node, Alloc> node_store;
+    typedef std::unique_ptr<node, typename node_store::deleter> node_ptr;
+
     struct node{
         std::shared_ptr<T> data;
         node * next;
@@ -224,10 +232,12 @@ private:
 };
 
 /*waiting for an item to pop*/
-template <typename  T>
+//"Alloc" is the allocation policy, see thread_queue
+template <typename  T, typename Alloc = std::allocator<T> >
 class final_queue{
 public:
-    final_queue():head(new node),tail(head){}
+    explicit final_queue(wait_strategy const & strategy_ = wait_strategy())
+        :head(node_store::create()),tail(head),strategy(strategy_){}
     final_queue(const final_queue & other) = delete;
     final_queue &operator=(const final_queue & other) = delete;
 
@@ -235,7 +245,7 @@ public:
         while(head){
             node * const old = head;
             head = old->next;
-            delete old;
+            node_store::destroy(old);
         }
     }
 
@@ -245,7 +255,7 @@ public:
             return std::shared_ptr<T>();
         }
         std::shared_ptr<T> const res(old_head->data);
-        delete old_head;
+        node_store::destroy(old_head);
         return res;
     }
 
@@ -254,32 +264,122 @@ public:
         if(!old_head){
             return false;
         }
-        delete old_head;
+        node_store::destroy(old_head);
         return true;
     }
 
+    //spin, then yield, then park on a futex according to "strategy" instead of going straight to sleep.
+    //both wait_and_pop overloads throw queue_closed once the queue is closed and drained, use wait_pop for a status instead
     std::shared_ptr<T> wait_and_pop(){
-        node * const old_head = wait_pop_head();
-        std::shared_ptr<T> const res(old_head->data);
-        delete old_head;
+        std::shared_ptr<T> res;
+        pop_status const status = wait_pop_loop(data_ready, is_closed, [&]{return bool(res = try_pop());},[&](std::uint32_t ticket){
+            data_ready.wait(ticket, strategy);
+            return true;
+        });
+        if(status == pop_status::closed){
+            throw queue_closed();
+        }
         return res;
     }
 
     void wait_and_pop(T & value){
-        node * const old_head = wait_pop_head(value);
-        delete old_head;
+        if(wait_pop(value) == pop_status::closed){
+            throw queue_closed();
+        }
+    }
+
+    //status-returning version: success, or closed when the queue is closed and drained
+    pop_status wait_pop(T & value){
+        return wait_pop_loop(data_ready, is_closed, [&]{return try_pop(value);},[&](std::uint32_t ticket){
+            data_ready.wait(ticket, strategy);
+            return true;
+        });
+    }
+
+    //timed versions, return timeout if nothing arrived before the deadline
+    template <typename Rep, typename Period>
+    pop_status wait_and_pop_for(T & value, std::chrono::duration<Rep, Period> const & timeout){
+        return wait_and_pop_until(value, std::chrono::steady_clock::now() + timeout);
+    }
+    template <typename Clock, typename Duration>
+    pop_status wait_and_pop_until(T & value, std::chrono::time_point<Clock, Duration> const & deadline){
+        return wait_pop_loop(data_ready, is_closed, [&]{return try_pop(value);},[&](std::uint32_t ticket){
+            return data_ready.wait_until(ticket, strategy, deadline);
+        });
+    }
+
+    //further pushes throw queue_closed; every waiter is woken at once, drains what is left and then sees "closed"
+    void close(){
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            is_closed.store(true, std::memory_order_release);
+        }
+        data_ready.notify_all();
+    }
+
+    bool closed() const{
+        return is_closed.load(std::memory_order_acquire);
     }
 
     void push(T new_value){
-        std::shared_ptr<T> new_data(new T(new_value));
-        std::unique_ptr<node> p(new node);
+        std::shared_ptr<T> data(make_policy_shared<T>(Alloc(), std::move(new_value)));
+        node_ptr p(node_store::create());
         {
             std::lock_guard<std::mutex> tail_lock(tail_mutex);
-            tail->data = new_data;
+            check_not_closed();
+            tail->data = data;
             tail->next = p.get();
             tail = p.release();
         }
-        data_cond.notify_one();
+        //only an atomic increment unless a consumer has actually parked
+        data_ready.notify_one();
+    }
+
+    //build the whole chain outside the lock, splice it in under a single hold of tail_mutex and wake the waiters once
+    //use std::make_move_iterator to move the items in
+    template <typename Iterator>
+    void push_range(Iterator first, Iterator last){
+        if(first == last){
+            return;
+        }
+        //the first item goes into the current dummy tail node, the last new node becomes the new dummy
+        std::shared_ptr<T> const first_data(make_policy_shared<T>(Alloc(), *first));
+        node_ptr chain(node_store::create());
+        node * chain_tail = chain.get();
+        try{
+            for(++first; first != last; ++first){
+                chain_tail->data = make_policy_shared<T>(Alloc(), *first);
+                chain_tail->next = node_store::create();
+                chain_tail = chain_tail->next;
+            }
+        } catch(...){
+            delete_chain(chain.release());
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            check_not_closed();
+            tail->data = first_data;
+            tail->next = chain.release();
+            tail = chain_tail;
+        }
+        data_ready.notify_all();
+    }
+
+    //detach up to max_n nodes under a single hold of head_mutex, then move the data out and free the nodes
+    //returns the number of items popped
+    template <typename OutputIterator>
+    std::size_t try_pop_bulk(OutputIterator out, std::size_t max_n){
+        node * old_head = try_pop_head_bulk(max_n);
+        std::size_t n = 0;
+        while(old_head){
+            node * const next = old_head->next;
+            *out++ = std::move(*old_head->data);
+            node_store::destroy(old_head);
+            old_head = next;
+            ++n;
+        }
+        return n;
     }
 
     void empty(){
@@ -287,6 +387,10 @@ public:
         return head == get_tail();
     }
 private:
+    struct node;
+    typedef policy_nodes<node, Alloc> node_store;
+    typedef std::unique_ptr<node, typename node_store::deleter> node_ptr;
+
     struct node{
         node() : next(nullptr){}
         std::shared_ptr<T> data;
@@ -312,28 +416,36 @@ private:
         return pop_head();
     }
 
-    node * try_pop_head(T & value){
+    //the returned chain is terminated by a null next pointer
+    node * try_pop_head_bulk(std::size_t max_n){
         std::lock_guard<std::mutex> head_lock(head_mutex);
-        if(head == get_tail()){
+        node * const old_tail = get_tail();
+        if(!max_n || head == old_tail){
             return nullptr;
         }
-        value = *head->data;
-        return pop_head();
-    }
-
-    std::unique_lock<std::mutex> wait_for_data(){
-        std::unique_lock<std::mutex> head_lock(head_mutex);
-        data_cond.wait(head_lock,[&]{return head != get_tail();});
-        return head_lock;
+        node * last = head;
+        for(std::size_t n = 1; n < max_n && last->next != old_tail; ++n){
+            last = last->next;
+        }
+        node * const old_head = head;
+        head = last->next;
+        last->next = nullptr;
+        return old_head;
     }
 
-    node * wait_pop_head(){
-        std::unique_lock<std::mutex> head_lock(wait_for_data());
-        return pop_head();
+    static void delete_chain(node * nodes){
+        while(nodes){
+            node * const next = nodes->next;
+            node_store::destroy(nodes);
+            nodes = next;
+        }
     }
 
-    node * wait_pop_head(T & value){
-        std::unique_lock<std::mutex> head_lock(wait_for_data());
+    node * try_pop_head(T & value){
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        if(head == get_tail()){
+            return nullptr;
+        }
         value = *head->data;
         return pop_head();
     }
@@ -342,6 +454,465 @@ private:
     node * head;
     std::mutex tail_mutex;
     node * tail;
+    parking_event data_ready;
+    wait_strategy strategy;
+    std::atomic<bool> is_closed{false};
+
+    //the caller holds tail_mutex
+    void check_not_closed() const{
+        if(is_closed.load(std::memory_order_relaxed)){
+            throw queue_closed();
+        }
+    }
+};
+
+/*an unbounded queue made of linked fixed-size segments*/
+//same blocking interface as final_queue (wait strategy, close, deadline pops), but items are stored inline in
+//arrays of "SegmentSize" slots: producers and consumers walk memory sequentially and the allocator is only hit
+//at segment boundaries. a drained segment is kept as a spare and reused for the next boundary.
+//"pushed" and "popped" count the items that went in and out; an item is visible to the consumers once "pushed" covers it.
+//segment size: 1024 slots spreads one allocation over a thousand pushes for small T, while an almost empty queue still
+//holds no more than the head segment, the tail segment and one spare.
+//reclamation: consumers only reach a segment's successor after the producer has published an item in it, so once the
+//consumer holding head_mutex drains a segment no thread can touch it again and it is recycled immediately, without
+//hazard pointers or epochs. the one spare is handed over with an atomic exchange because the producer and the consumer
+//hold different locks; any further drained segment is deleted so a burst does not pin memory.
+//memory ordering: the producer constructs the item (and links a new segment) with plain writes under tail_mutex and
+//then publishes them with a release store to "pushed", which consumers load with acquire before reading a slot.
+//"popped" is released after the item is destroyed, for empty() and the destructor. each side's state has its own line.
+template <typename T, std::size_t SegmentSize = 1024>
+class segmented_queue{
+public:
+    explicit segmented_queue(wait_strategy const & strategy_ = wait_strategy())
+        :head_segment(new segment),head_index(0),popped(0),
+         tail_segment(head_segment),tail_index(0),pushed(0),
+         spare(nullptr),strategy(strategy_){}
+    segmented_queue(const segmented_queue &) = delete;
+    segmented_queue &operator=(const segmented_queue &) = delete;
+
+    ~segmented_queue(){
+        for(std::size_t n = pushed.load() - popped.load(); n; --n){
+            if(head_index == SegmentSize){
+                advance_head_segment();
+            }
+            head_segment->slots[head_index++].value()->~T();
+        }
+        while(head_segment){
+            segment * const next = head_segment->next;
+            delete head_segment;
+            head_segment = next;
+        }
+        delete spare.load();
+    }
+
+    void push(T new_value){
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            check_not_closed();
+            emplace_back(std::move(new_value));
+        }
+        data_ready.notify_one();
+    }
+
+    //all items are written under a single hold of tail_mutex and the waiters are woken once
+    template <typename Iterator>
+    void push_range(Iterator first, Iterator last){
+        if(first == last){
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            check_not_closed();
+            for(; first != last; ++first){
+                emplace_back(*first);
+            }
+        }
+        data_ready.notify_all();
+    }
+
+    bool try_pop(T & value){
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        if(popped.load(std::memory_order_relaxed) == pushed.load(std::memory_order_acquire)){
+            return false;
+        }
+        take_front([&](T & item){value = std::move(item);});
+        return true;
+    }
+
+    std::shared_ptr<T> try_pop(){
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        if(popped.load(std::memory_order_relaxed) == pushed.load(std::memory_order_acquire)){
+            return std::shared_ptr<T>();
+        }
+        std::shared_ptr<T> res;
+        take_front([&](T & item){res = std::make_shared<T>(std::move(item));});
+        return res;
+    }
+
+    //moves up to max_n items to "out" under a single hold of head_mutex, returns the number of items popped
+    template <typename OutputIterator>
+    std::size_t try_pop_bulk(OutputIterator out, std::size_t max_n){
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        std::size_t const available = pushed.load(std::memory_order_acquire) - popped.load(std::memory_order_relaxed);
+        std::size_t const n = std::min(max_n, available);
+        for(std::size_t i = 0; i < n; ++i){
+            take_front([&](T & item){*out++ = std::move(item);});
+        }
+        return n;
+    }
+
+    //blocking pops, see final_queue
+    std::shared_ptr<T> wait_and_pop(){
+        std::shared_ptr<T> res;
+        pop_status const status = wait_pop_loop(data_ready, is_closed, [&]{return bool(res = try_pop());},[&](std::uint32_t ticket){
+            data_ready.wait(ticket, strategy);
+            return true;
+        });
+        if(status == pop_status::closed){
+            throw queue_closed();
+        }
+        return res;
+    }
+
+    void wait_and_pop(T & value){
+        if(wait_pop(value) == pop_status::closed){
+            throw queue_closed();
+        }
+    }
+
+    pop_status wait_pop(T & value){
+        return wait_pop_loop(data_ready, is_closed, [&]{return try_pop(value);},[&](std::uint32_t ticket){
+            data_ready.wait(ticket, strategy);
+            return true;
+        });
+    }
+
+    template <typename Rep, typename Period>
+    pop_status wait_and_pop_for(T & value, std::chrono::duration<Rep, Period> const & timeout){
+        return wait_and_pop_until(value, std::chrono::steady_clock::now() + timeout);
+    }
+    template <typename Clock, typename Duration>
+    pop_status wait_and_pop_until(T & value, std::chrono::time_point<Clock, Duration> const & deadline){
+        return wait_pop_loop(data_ready, is_closed, [&]{return try_pop(value);},[&](std::uint32_t ticket){
+            return data_ready.wait_until(ticket, strategy, deadline);
+        });
+    }
+
+    void close(){
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            is_closed.store(true, std::memory_order_release);
+        }
+        data_ready.notify_all();
+    }
+
+    bool closed() const{
+        return is_closed.load(std::memory_order_acquire);
+    }
+
+    bool empty() const{
+        return popped.load(std::memory_order_acquire) == pushed.load(std::memory_order_acquire);
+    }
+
+private:
+    struct slot{
+        alignas(T) unsigned char storage[sizeof(T)];
+        T * value(){
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+    struct segment{
+        slot slots[SegmentSize];
+        segment * next;
+        segment(): next(nullptr){}
+    };
+
+    //the caller holds tail_mutex
+    template <typename U>
+    void emplace_back(U && new_value){
+        if(tail_index == SegmentSize){
+            segment * const next = take_spare();
+            tail_segment->next = next;
+            tail_segment = next;
+            tail_index = 0;
+        }
+        new (tail_segment->slots[tail_index].storage) T(std::forward<U>(new_value));
+        ++tail_index;
+        //publishes the item (and the link to a new segment) to the consumers
+        pushed.store(pushed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //the caller holds head_mutex and has checked that an item is available
+    template <typename Sink>
+    void take_front(Sink sink){
+        if(head_index == SegmentSize){
+            advance_head_segment();
+        }
+        T * const p = head_segment->slots[head_index].value();
+        sink(*p);
+        p->~T();
+        ++head_index;
+        popped.store(popped.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //the current head segment is drained; its successor is linked because an item after it has been published
+    void advance_head_segment(){
+        segment * const old_segment = head_segment;
+        head_segment = old_segment->next;
+        head_index = 0;
+        old_segment->next = nullptr;
+        segment * expected = nullptr;
+        if(!spare.compare_exchange_strong(expected, old_segment)){
+            delete old_segment;
+        }
+    }
+
+    segment * take_spare(){
+        segment * const s = spare.exchange(nullptr);
+        return s ? s : new segment;
+    }
+
+    //the caller holds tail_mutex
+    void check_not_closed() const{
+        if(is_closed.load(std::memory_order_relaxed)){
+            throw queue_closed();
+        }
+    }
+
+    //consumer side
+    alignas(cache_line_size) std::mutex head_mutex;
+    segment * head_segment;
+    std::size_t head_index;
+    std::atomic<std::size_t> popped;
+    //producer side
+    alignas(cache_line_size) std::mutex tail_mutex;
+    segment * tail_segment;
+    std::size_t tail_index;
+    std::atomic<std::size_t> pushed;
+
+    alignas(cache_line_size) std::atomic<segment *> spare;
+    parking_event data_ready;
+    wait_strategy strategy;
+    std::atomic<bool> is_closed{false};
+};
+
+/*a wait-free single-producer/single-consumer ring queue*/
+//only the producer writes "tail" and only the consumer writes "head", so each side publishes its index with a release
+//store and reads the other side's index with an acquire load; no mutex and no read-modify-write is needed.
+//each side also keeps a private copy of the other side's index and only reloads it (touching the other side's cache line)
+//when the cached value says the queue is full/empty.
+template <typename T>
+class spsc_queue{
+public:
+    //capacity is rounded up to a power of two
+    explicit spsc_queue(std::size_t capacity)
+        :mask(round_up_pow2(capacity) - 1),slots(new slot[mask + 1]),
+         head(0),cached_tail(0),tail(0),cached_head(0){}
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    ~spsc_queue(){
+        std::size_t const t = tail.load(std::memory_order_relaxed);
+        for(std::size_t h = head.load(std::memory_order_relaxed); h != t; ++h){
+            slots[h & mask].value()->~T();
+        }
+    }
+
+    //producer side
+    bool try_push(T const & new_value){
+        return do_try_push(new_value);
+    }
+    bool try_push(T && new_value){
+        return do_try_push(std::move(new_value));
+    }
+
+    //producer side, moves up to n items from [first, first + n) and publishes them with a single store
+    //returns the number of items pushed
+    template <typename Iterator>
+    std::size_t try_push_bulk(Iterator first, std::size_t n){
+        std::size_t const t = tail.load(std::memory_order_relaxed);
+        std::size_t free_slots = capacity() - (t - cached_head);
+        if(free_slots < n){
+            cached_head = head.load(std::memory_order_acquire);
+            free_slots = capacity() - (t - cached_head);
+        }
+        n = std::min(n, free_slots);
+        for(std::size_t i = 0; i < n; ++i, ++first){
+            new (slots[(t + i) & mask].storage) T(std::move(*first));
+        }
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    //consumer side
+    bool try_pop(T & value){
+        std::size_t const h = head.load(std::memory_order_relaxed);
+        if(h == cached_tail){
+            cached_tail = tail.load(std::memory_order_acquire);
+            if(h == cached_tail){
+                return false;
+            }
+        }
+        T * const p = slots[h & mask].value();
+        value = std::move(*p);
+        p->~T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //consumer side, moves up to max_n items to "out" and releases their slots with a single store
+    //returns the number of items popped
+    template <typename OutputIterator>
+    std::size_t try_pop_bulk(OutputIterator out, std::size_t max_n){
+        std::size_t const h = head.load(std::memory_order_relaxed);
+        if(cached_tail - h < max_n){
+            cached_tail = tail.load(std::memory_order_acquire);
+        }
+        std::size_t const n = std::min(max_n, cached_tail - h);
+        for(std::size_t i = 0; i < n; ++i){
+            T * const p = slots[(h + i) & mask].value();
+            *out++ = std::move(*p);
+            p->~T();
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    //exact when called by the consumer, a snapshot otherwise
+    bool empty() const{
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const{
+        return mask + 1;
+    }
+
+private:
+    struct slot{
+        alignas(T) unsigned char storage[sizeof(T)];
+        T * value(){
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    static std::size_t round_up_pow2(std::size_t n){
+        std::size_t res = 1;
+        while(res < n){
+            res <<= 1;
+        }
+        return res;
+    }
+
+    template <typename U>
+    bool do_try_push(U && new_value){
+        std::size_t const t = tail.load(std::memory_order_relaxed);
+        if(t - cached_head == capacity()){
+            cached_head = head.load(std::memory_order_acquire);
+            if(t - cached_head == capacity()){
+                return false;
+            }
+        }
+        new (slots[t & mask].storage) T(std::forward<U>(new_value));
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::size_t const mask;
+    std::unique_ptr<slot[]> const slots;
+    //consumer-owned line
+    alignas(cache_line_size) std::atomic<std::size_t> head;
+    std::size_t cached_tail;
+    //producer-owned line
+    alignas(cache_line_size) std::atomic<std::size_t> tail;
+    std::size_t cached_head;
+};
+
+/*blocking adapter over spsc_queue*/
+//the consumer spins briefly and only parks on the condition variable when the queue is really empty;
+//the producer only touches the mutex when it sees that the consumer has parked.
+template <typename T>
+class blocking_spsc_queue{
+public:
+    explicit blocking_spsc_queue(std::size_t capacity, unsigned spin_count = 128)
+        :queue(capacity),spins(spin_count),consumer_waiting(false){}
+    blocking_spsc_queue(const blocking_spsc_queue &) = delete;
+    blocking_spsc_queue &operator=(const blocking_spsc_queue &) = delete;
+
+    //producer side, yields while the queue is full
+    void push(T new_value){
+        while(!queue.try_push(std::move(new_value))){
+            std::this_thread::yield();
+        }
+        wake_consumer();
+    }
+
+    template <typename Iterator>
+    void push_bulk(Iterator first, std::size_t n){
+        while(n){
+            std::size_t const pushed = queue.try_push_bulk(first, n);
+            if(pushed){
+                std::advance(first, pushed);
+                n -= pushed;
+                wake_consumer();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    //consumer side
+    bool try_pop(T & value){
+        return queue.try_pop(value);
+    }
+
+    void wait_and_pop(T & value){
+        while(!queue.try_pop(value)){
+            wait_for_data();
+        }
+    }
+
+    //blocks until at least one item is available, then takes up to max_n items
+    template <typename OutputIterator>
+    std::size_t wait_and_pop_bulk(OutputIterator out, std::size_t max_n){
+        std::size_t n;
+        while(!(n = queue.try_pop_bulk(out, max_n))){
+            wait_for_data();
+        }
+        return n;
+    }
+
+    bool empty() const{
+        return queue.empty();
+    }
+
+private:
+    void wait_for_data(){
+        for(unsigned i = 0; i < spins; ++i){
+            if(!queue.empty()){
+                return;
+            }
+        }
+        std::unique_lock<std::mutex> lk(mut);
+        consumer_waiting.store(true, std::memory_order_relaxed);
+        //pairs with the fence in wake_consumer(): either the producer sees consumer_waiting,
+        //or we see the item it has just published
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        data_cond.wait(lk,[this]{return !queue.empty();});
+        consumer_waiting.store(false, std::memory_order_relaxed);
+    }
+
+    void wake_consumer(){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(consumer_waiting.load(std::memory_order_relaxed)){
+            std::lock_guard<std::mutex> lk(mut);
+            data_cond.notify_one();
+        }
+    }
+
+    spsc_queue<T> queue;
+    unsigned const spins;
+    std::atomic<bool> consumer_waiting;
+    std::mutex mut;
     std::condition_variable data_cond;
 };
 
@@ -2,6 +2,7 @@
 #define T_THREAD_STACK_H
 
 #include "common.h"
+#include "../hazard_pointer.h"
 
 template<typename T>
 class stack{
@@ -13,6 +14,14 @@ private:
     };
     std::atomic<node*> head;
 public:
+    stack():head(nullptr),threads_in_pop(0),to_be_deleted(nullptr){}
+    stack(stack const &) = delete;
+    stack & operator=(stack const &) = delete;
+    ~stack(){
+        delete_nodes(head.load(std::memory_order_relaxed));
+        delete_nodes(to_be_deleted.load(std::memory_order_relaxed));
+    }
+
     void push(T const & data){
         node * const new_node = new node(data);
         new_node->next = head.load();
@@ -49,7 +58,7 @@ public:
         }
     }
 
-    std::shared_ptr<T> pop(){
+    std::shared_ptr<T> pop_counting_threads(){
         ++threads_in_pop;
         node * old_head = head.load();
         while(old_head && !head.compare_exchange_weak(old_head,old_head->next));
@@ -78,29 +87,20 @@ public:
     //the basic idea is that if a thread is going to access an object that another thread might wat to delete
     //then it first sets a hazard pointer to reference the object, thus informing the other thread that deleting the object would indeed be hazardous.
 
+    //hazard_domain keeps the slots and the retire lists: a retired node is freed by a later scan of the retiring
+    //thread once no slot points at it, and scans only run when the list has grown past twice the number of slots
     std::shared_ptr<T> pop(){
-        //std::atomic_address & hp = get_hazard_pointer_for_current_thread();
-        std::atomic<void *> & hp = get_hazard_pointer_for_current_thread();
-        node * old_head = head.load();
+        hazard_domain::holder hp;
+        node * old_head;
         do{
-            node * temp;
-            do{
-                temp = old_head;
-                hp.store(old_head);
-                //in case other threads update head node
-                old_head = head.load();
-            }while(old_head != temp);
+            //protect() stores the pointer and re-reads head in case other threads updated it meanwhile
+            old_head = hp.protect(head);
         }while(old_head && !head.compare_exchange_strong(old_head,old_head->next));
-        hp.store(nullptr);
+        hp.reset();
         std::shared_ptr<T> res;
         if(old_head){
             res.swap(old_head->data);
-            if(outstanding_hazard_pointers_for(old_head)){
-                reclaim_later(old_head);
-            } else {
-                delete old_head;
-            }
-            delete_nodes_with_no_hazards();
+            hazard_domain::retire(old_head);
         }
         return res;
     }
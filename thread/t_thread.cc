@@ -32,6 +32,21 @@ void consumer(){
     }
 }
 
+void spsc_producer(){
+    for (auto i = 0; i < 10 ;++i){
+        spsc_vec.push(i+1);
+        std::cout<<"produce:  "<<i+1<<std::endl;
+    }
+}
+
+void spsc_consumer(){
+    for (auto i = 0; i < 10 ;++i){
+        int data = 0;
+        spsc_vec.wait_and_pop(data);
+        std::cout<<"consume:  "<<data<<std::endl;
+    }
+}
+
 
 //2.7 spawn some threads and wait for them to finish
 void do_work(unsigned id){
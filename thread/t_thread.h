@@ -6,6 +6,7 @@
 #define T_THREADS_THREAD_H
 
 #include "common.h"
+#include "t_queue.h"
 
 //
 template <int N, int M>
@@ -21,6 +22,12 @@ inline std::vector<int>  vec;
 void producer();
 void consumer();
 
+//the same handoff without mutex/condition_variable per item: one producer, one consumer
+inline blocking_spsc_queue<int> spsc_vec(16);
+
+void spsc_producer();
+void spsc_consumer();
+
 class background_task{
 public:
     void operator()() const{
@@ -0,0 +1,188 @@
+#ifndef __WAIT_STRATEGY_H_
+#define __WAIT_STRATEGY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <exception>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// 阻塞pop的等待策略：先忙等spin_count次(每次一条pause指令)，再让出CPU yield_count次，最后才挂起线程。
+// 下一个元素往往在几百纳秒内就会到达，这时忙等可以省掉一次系统调用和上下文切换。
+// spin_count和yield_count都设为0就退化成直接挂起
+struct wait_strategy {
+    unsigned spin_count = 128;
+    unsigned yield_count = 16;
+};
+
+// 带状态的阻塞pop的结果
+// closed表示队列已经关闭并且已经取空，之后不会再有数据
+enum class pop_status {
+    success,
+    timeout,
+    closed
+};
+
+// 对已关闭的队列push，或者在已关闭且取空的队列上调用不返回状态的wait_and_pop
+struct queue_closed : std::exception {
+    const char * what() const throw() {
+        return "queue closed";
+    }
+};
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// 等待/唤醒事件
+// seq是一个序号，每次notify加一；等待者先用prepare_wait()记下序号，确认条件不满足后再调用wait()，
+// 只要这期间有过notify，wait()就会立即返回，不会丢失唤醒。
+// 挂起使用futex直接睡在seq上；只有确实有线程挂起时(parked > 0)，notify才会调用futex唤醒。
+class parking_event {
+public:
+    parking_event() : seq(0), parked(0) {}
+    parking_event(parking_event const &) = delete;
+    parking_event & operator=(parking_event const &) = delete;
+
+    std::uint32_t prepare_wait() const {
+        return seq.load(std::memory_order_acquire);
+    }
+
+    // 等到ticket之后有过notify为止
+    void wait(std::uint32_t ticket, wait_strategy const & strategy) {
+        if (spin(ticket, strategy)) {
+            return;
+        }
+        // 和notify中的fetch_add/load配对(都是seq_cst)：要么notify看到parked，要么这里看到seq已经变化
+        parked.fetch_add(1, std::memory_order_seq_cst);
+        while (seq.load(std::memory_order_seq_cst) == ticket) {
+            park(ticket);
+        }
+        parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // 带超时的版本，在deadline之前有过notify返回true，超时返回false
+    template <typename Clock, typename Duration>
+    bool wait_until(std::uint32_t ticket, wait_strategy const & strategy, std::chrono::time_point<Clock, Duration> const & deadline) {
+        if (spin(ticket, strategy)) {
+            return true;
+        }
+        bool notified = true;
+        parked.fetch_add(1, std::memory_order_seq_cst);
+        while (seq.load(std::memory_order_seq_cst) == ticket) {
+            auto const now = Clock::now();
+            if (now >= deadline) {
+                notified = false;
+                break;
+            }
+            park_for(ticket, std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now));
+        }
+        parked.fetch_sub(1, std::memory_order_relaxed);
+        return notified;
+    }
+
+    void notify_one() {
+        seq.fetch_add(1, std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_seq_cst)) {
+            unpark(1);
+        }
+    }
+
+    void notify_all() {
+        seq.fetch_add(1, std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_seq_cst)) {
+            unpark(INT32_MAX);
+        }
+    }
+
+private:
+    static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futex word must be a plain 32-bit integer");
+
+    std::atomic<std::uint32_t> seq;
+    std::atomic<std::uint32_t> parked;
+
+    bool spin(std::uint32_t ticket, wait_strategy const & strategy) const {
+        for (unsigned i = 0; i < strategy.spin_count; ++i) {
+            if (seq.load(std::memory_order_acquire) != ticket) {
+                return true;
+            }
+            cpu_relax();
+        }
+        for (unsigned i = 0; i < strategy.yield_count; ++i) {
+            if (seq.load(std::memory_order_acquire) != ticket) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    std::uint32_t * futex_word() {
+        return reinterpret_cast<std::uint32_t *>(&seq);
+    }
+
+    // 内核会先比较seq和ticket，不相等就立即返回，所以检查和挂起之间不存在竞争窗口
+    void park(std::uint32_t ticket) {
+#ifdef __linux__
+        syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, ticket, nullptr, nullptr, 0);
+#else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+    }
+
+    // FUTEX_WAIT的超时是相对时间，被提前唤醒或者信号打断时由调用者重新计算剩余时间
+    void park_for(std::uint32_t ticket, std::chrono::nanoseconds timeout) {
+#ifdef __linux__
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, ticket, &ts, nullptr, 0);
+#else
+        std::this_thread::sleep_for(timeout < std::chrono::microseconds(50) ? timeout : std::chrono::nanoseconds(std::chrono::microseconds(50)));
+#endif
+    }
+
+    void unpark(int count) {
+#ifdef __linux__
+        syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+        (void)count;
+#endif
+    }
+};
+
+// 可关闭队列的阻塞pop循环，ready是队列的数据就绪事件，closed是队列的关闭标志
+// 先记下事件序号再尝试pop，尝试失败后的push/close一定会让wait立即返回；
+// 在尝试之前读到关闭标志，尝试又失败，说明关闭之前push进来的数据都已经被取完。
+// try_once()返回是否取到了数据，wait(ticket)等待ticket之后的通知，返回false表示超时
+template <typename TryPop, typename Wait>
+pop_status wait_pop_loop(parking_event const & ready, std::atomic<bool> const & closed, TryPop try_once, Wait wait) {
+    for (;;) {
+        std::uint32_t const ticket = ready.prepare_wait();
+        bool const was_closed = closed.load(std::memory_order_acquire);
+        if (try_once()) {
+            return pop_status::success;
+        }
+        if (was_closed) {
+            return pop_status::closed;
+        }
+        if (!wait(ticket)) {
+            return pop_status::timeout;
+        }
+    }
+}
+
+#endif